@@ -0,0 +1,250 @@
+// The shared memory segment that gpumon --shm publishes the newest sample of
+// every card in, and a reader for it. gpumon includes this header too, so
+// the layout seen by readers is the one it writes.
+//
+// The segment holds a header followed by one card per GPU. Every update is
+// written under a sequence lock: the sequence is odd while gpumon writes and
+// grows by two with every update, so a reader copies the cards and retries
+// if the sequence changed meanwhile. Once opened, reading takes no system
+// calls and never touches sysfs, however many readers there are.
+//
+//     gpumon_shm::reader r;
+//     if (r.open()) {
+//         std::vector<gpumon_shm::card> cards;
+//         if (r.read(cards)) {
+//             auto power = r.row("power");
+//             if (!cards.empty() && cards[0].has(power)) {
+//                 ... cards[0].values[power] ...
+//             }
+//         }
+//     }
+#ifndef GPUMON_SHM_HPP
+#define GPUMON_SHM_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+namespace gpumon_shm {
+
+constexpr const char *default_name = "/gpumon";
+constexpr std::uint32_t magic = 0x4d485347u; // "GSHM"
+constexpr std::uint32_t version = 1;
+constexpr std::size_t max_rows = 32;
+constexpr std::size_t name_size = 32;
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free &&
+              std::atomic<std::int32_t>::is_always_lock_free,
+              "the sequence lock needs address-free atomics");
+
+// The newest values of one card, indexed by row, in the units sysfs reports
+// them in: percent, bytes, microwatts, millidegrees Celsius, RPM, millivolts
+// and Hz. The link speed is in MT/s, the link width in lanes, energy in
+// microjoules since gpumon started and the DPM level rows hold the current
+// level. Oversampled rows hold their mean over the update.
+struct card {
+    char name[name_size]; // e.g. "card0"
+    std::uint64_t time;   // milliseconds since the epoch
+    std::uint32_t valid;  // one bit per row that was read successfully
+    std::uint32_t reserved;
+    std::uint64_t values[max_rows];
+
+    // The totals and caps that gpumon draws the bars against.
+    std::uint64_t vram_total;
+    std::uint64_t gtt_total;
+    std::uint64_t vis_vram_total;
+    std::uint64_t power_cap_min;
+    std::uint64_t power_cap_max;
+    std::uint64_t temp_crit;
+    std::uint64_t fan_min;
+    std::uint64_t fan_max;
+
+    bool has(int row) const
+    {
+        return row >= 0 && static_cast<std::size_t>(row) < max_rows && (valid & (1u << row));
+    }
+};
+
+struct header {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t header_size;
+    std::uint32_t card_size;
+    std::uint32_t card_count;
+    std::uint32_t row_count;
+    std::int64_t interval_ns; // negative if gpumon only samples when asked
+    char rows[max_rows][name_size]; // the names --enable and --disable take
+    // Odd while an update is written.
+    std::atomic<std::uint64_t> sequence;
+    // gpumon's process id, or 0 once it has exited.
+    std::atomic<std::int32_t> writer;
+    std::uint32_t reserved;
+};
+
+inline std::size_t segment_size(std::size_t cards)
+{
+    return sizeof(header) + cards * sizeof(card);
+}
+
+inline card *cards_of(header *h)
+{
+    return reinterpret_cast<card *>(h + 1);
+}
+
+inline const card *cards_of(const header *h)
+{
+    return reinterpret_cast<const card *>(h + 1);
+}
+
+// Starts and ends an update of the cards that follow h.
+inline void begin_write(header &h)
+{
+    h.sequence.store(h.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void end_write(header &h)
+{
+    h.sequence.store(h.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Maps a segment published by gpumon read only.
+class reader {
+public:
+    reader() = default;
+
+    reader(const reader &) = delete;
+    reader &operator=(const reader &) = delete;
+
+    ~reader()
+    {
+        close();
+    }
+
+    // Fails if there is no segment called name or it was written by an
+    // incompatible gpumon. The segment stays mapped after gpumon exits, so
+    // open it again once live() returns false.
+    bool open(const char *name = default_name)
+    {
+        close();
+        int fd = ::shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        void *data = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(header)) {
+            data = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        m_header = static_cast<const header *>(data);
+        m_size = static_cast<std::size_t>(st.st_size);
+        if (m_header->magic != magic || m_header->version != version ||
+            m_header->header_size != sizeof(header) || m_header->card_size != sizeof(card) ||
+            m_header->row_count > max_rows || segment_size(m_header->card_count) > m_size) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (m_header) {
+            ::munmap(const_cast<header *>(m_header), m_size);
+            m_header = nullptr;
+            m_size = 0;
+        }
+    }
+
+    bool is_open() const
+    {
+        return m_header != nullptr;
+    }
+
+    // Whether gpumon is still publishing to the segment.
+    bool live() const
+    {
+        return m_header->writer.load(std::memory_order_relaxed) != 0;
+    }
+
+    std::size_t card_count() const
+    {
+        return m_header->card_count;
+    }
+
+    std::int64_t interval_ns() const
+    {
+        return m_header->interval_ns;
+    }
+
+    // Returns the index of the row called name, e.g. "busy" or "power", or
+    // -1 if there is none.
+    int row(std::string_view name) const
+    {
+        for (std::uint32_t i = 0; i < m_header->row_count; ++i) {
+            if (name == std::string_view(m_header->rows[i], ::strnlen(m_header->rows[i], name_size))) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    // Grows by one with every update, so polling it tells whether read()
+    // would return anything new.
+    std::uint64_t updates() const
+    {
+        return m_header->sequence.load(std::memory_order_acquire) / 2;
+    }
+
+    // Copies the newest update of every card into out, which only allocates
+    // the first time. Returns false if gpumon stayed in the middle of an
+    // update throughout, e.g. because it was killed there.
+    bool read(std::vector<card> &out) const
+    {
+        out.resize(m_header->card_count);
+        return read(out.data(), out.size());
+    }
+
+    // Copies the newest update of the first count cards into out.
+    bool read(card *out, std::size_t count) const
+    {
+        if (count > m_header->card_count) {
+            count = m_header->card_count;
+        }
+        auto *src = cards_of(m_header);
+        for (int tries = 0; tries < max_tries; ++tries) {
+            auto before = m_header->sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+            std::memcpy(out, src, count * sizeof(card));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_header->sequence.load(std::memory_order_relaxed) == before) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static constexpr int max_tries = 1 << 20;
+
+    const header *m_header = nullptr;
+    std::size_t m_size = 0;
+};
+
+} // namespace gpumon_shm
+
+#endif
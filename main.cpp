@@ -1,19 +1,89 @@
+#include <fcntl.h>
 #include <getopt.h>
+#include <langinfo.h>
 #include <ncurses.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef GPUMON_HAVE_LIBDRM
+#include <amdgpu.h>
+#include <amdgpu_drm.h>
+#endif
+
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cerrno>
+#include <charconv>
+#include <clocale>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <cstddef>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <optional>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gpumon_shm.hpp"
 
 namespace {
 const int end_of_transmission = 4;
 const int escape = 27;
 
+// Counts of the work gpumon does, for --bench and the self statistics. Only
+// the system calls made to read sensors are counted.
+namespace counters {
+std::atomic<std::uint64_t> syscalls{0};
+std::atomic<std::uint64_t> allocations{0};
+
+// Only gpumon_bench replaces operator new to count allocations.
+#ifdef GPUMON_COUNT_ALLOCATIONS
+constexpr bool count_allocations = true;
+#else
+constexpr bool count_allocations = false;
+#endif
+
+void count_syscall()
+{
+    syscalls.fetch_add(1, std::memory_order_relaxed);
+}
+}
+
 namespace color {
     bool use_color = true;
     enum class type {
@@ -39,474 +109,6850 @@ void remove_color(color::type color)
     }
 }
 
-void print_string(color::type color, const std::string &str, int attr = 0)
+void print_string(color::type color, std::string_view str, int attr = 0)
 {
     attron(attr);
     set_color(color);
-    addstr(str.c_str());
+    addnstr(str.data(), static_cast<int>(str.size()));
     remove_color(color);
     attroff(attr);
 }
 
-class device {
-public:
-    device(std::string_view path)
-        : m_path(path)
-    {
-        m_vram = std::stoull(read_file("mem_info_vram_total"));
-        m_vram_str = '/' + std::to_string(m_vram / (1024ull * 1024ull)) + "MiB";
+namespace info {
+enum {
+    busy,
+    vram,
+    gtt,
+    cpu_vis,
+    power,
+    temperature,
+    fan,
+    voltage,
+    gfx_clock,
+    mem_clock,
+    link_speed,
+    link_width,
+    pcie_bw,
+    energy,
+    sclk_level,
+    mclk_level,
+
+    row_count
+};
+
+// How the file of a row is parsed.
+enum class parse {
+    integer,
+    // A decimal such as the link speed "8.0 GT/s PCIe", kept in thousandths.
+    decimal,
+    // The "received sent max_payload" packet counts of pcie_bw over the last
+    // second, kept in bytes per second.
+    counts,
+    // A DPM table such as pp_dpm_sclk, one "N: 500Mhz" line per level with
+    // the current one marked by a '*', kept as the index of that level.
+    levels,
+};
+
+// How often a file is read. Fixed ones are read once, slow ones are cached
+// and read again every slow_refresh, e.g. the link speed, which only changes
+// when the link is renegotiated, or the power cap, which can be changed at
+// runtime.
+enum class refresh {
+    fixed,
+    slow,
+    tick,
+};
 
-        m_gtt = std::stoull(read_file("mem_info_gtt_total"));
-        m_gtt_str = '/' + std::to_string(m_gtt / (1024ull * 1024ull)) + "MiB";
+const std::int64_t slow_refresh = 30000000000ll;
 
-        m_vis_vram = std::stoull(read_file("mem_info_vis_vram_total"));
-        m_vis_vram_str = '/' + std::to_string(m_vis_vram / (1024ull * 1024ull)) + "MiB";
+// What the bar of a row is drawn against, see bar_range().
+enum class bound {
+    none,
+    percent,
+    vram,
+    gtt,
+    vis_vram,
+    power,
+    temperature,
+    fan,
+};
+
+// How a row is drawn: as a bar, as its value or as the share of time spent at
+// each DPM level.
+enum class display {
+    bar,
+    text,
+    residency,
+};
 
-        m_power_min = std::stoull(read_file("hwmon/hwmon1/power1_cap_min"));
-        m_power_max = std::stoull(read_file("hwmon/hwmon1/power1_cap_max"));
+// Everything there is to know about a row: where it is read from and how it
+// is parsed, shown and exported. Probing, sampling, drawing, --disable and
+// every output format are driven by this table.
+struct metric {
+    std::string_view name;     // used by --disable and in CSV, JSON and recordings
+    std::string_view label;
+    std::string_view file;     // relative to the device directory or its hwmon node
+    bool hwmon;
+    parse format;
+    refresh cadence;
+    bound normalize;
+    display kind;
+    bool default_on;           // rows that are off by default need --enable
+    std::string_view prefix;   // the value is shown as prefix, value / divisor,
+    std::uint64_t divisor;     // one decimal if decimal, "/" and the bound if it
+    bool decimal;              // is a total, and suffix
+    std::string_view suffix;
+    std::string_view export_name;
+    std::string_view help;
+    std::uint64_t export_divisor;
+    std::uint64_t export_multiplier;
+};
+
+constexpr std::uint64_t mib = 1024ull * 1024ull;
+
+constexpr metric metrics[] = {
+    {"busy", "GPU busy:", "gpu_busy_percent", false, parse::integer, refresh::tick,
+     bound::percent, display::bar, true, "", 1, false, "%",
+     "gpumon_busy_percent", "GPU busy percentage", 1, 1},
+    {"vram", "GPU vram:", "mem_info_vram_used", false, parse::integer, refresh::tick,
+     bound::vram, display::bar, true, "", mib, false, "MiB",
+     "gpumon_vram_used_bytes", "VRAM in use", 1, 1},
+    {"gtt", "GTT:", "mem_info_gtt_used", false, parse::integer, refresh::tick,
+     bound::gtt, display::bar, true, "", mib, false, "MiB",
+     "gpumon_gtt_used_bytes", "GTT memory in use", 1, 1},
+    {"cpu_vis", "CPU Vis:", "mem_info_vis_vram_used", false, parse::integer, refresh::tick,
+     bound::vis_vram, display::bar, true, "", mib, false, "MiB",
+     "gpumon_vis_vram_used_bytes", "CPU visible VRAM in use", 1, 1},
+    {"power", "Power draw:", "power1_average", true, parse::integer, refresh::tick,
+     bound::power, display::bar, true, "", 1000000, false, "W",
+     "gpumon_power_watts", "Average power draw", 1000000, 1},
+    {"temperature", "Temperature:", "temp1_input", true, parse::integer, refresh::tick,
+     bound::temperature, display::bar, true, "", 1000, false, "C",
+     "gpumon_temperature_celsius", "Edge temperature", 1000, 1},
+    {"fan", "Fan speed:", "fan1_input", true, parse::integer, refresh::tick,
+     bound::fan, display::bar, true, "", 1, false, "RPM",
+     "gpumon_fan_speed_rpm", "Fan speed", 1, 1},
+    {"voltage", "Voltage:", "in0_input", true, parse::integer, refresh::tick,
+     bound::none, display::text, true, "", 1, false, "mV",
+     "gpumon_voltage_volts", "GFX voltage", 1000, 1},
+    {"gfx_clock", "GFX clock:", "freq1_input", true, parse::integer, refresh::tick,
+     bound::none, display::text, true, "", 1000000, false, "MHz",
+     "gpumon_gfx_clock_hertz", "GFX clock", 1, 1},
+    {"mem_clock", "Mem clock:", "freq2_input", true, parse::integer, refresh::tick,
+     bound::none, display::text, true, "", 1000000, false, "MHz",
+     "gpumon_mem_clock_hertz", "Memory clock", 1, 1},
+    {"link_speed", "Link speed:", "current_link_speed", false, parse::decimal, refresh::slow,
+     bound::none, display::text, true, "", 1000, true, " GT/s",
+     "gpumon_pcie_link_speed_transfers_per_second", "PCIe link speed", 1, 1000000},
+    {"link_width", "Link width:", "current_link_width", false, parse::integer, refresh::slow,
+     bound::none, display::text, true, "x", 1, false, "",
+     "gpumon_pcie_link_width_lanes", "PCIe link width", 1, 1},
+    // The driver takes a second to measure pcie_bw on every read.
+    {"pcie_bw", "PCIe bw:", "pcie_bw", false, parse::counts, refresh::tick,
+     bound::none, display::text, false, "", 1000000, true, " MB/s",
+     "gpumon_pcie_bandwidth_bytes_per_second", "PCIe bandwidth", 1, 1},
+    // The energy used since gpumon started, see rate_stage.
+    {"energy", "Energy:", "energy1_input", true, parse::integer, refresh::tick,
+     bound::none, display::text, false, "", 3600000000ull, true, " Wh",
+     "gpumon_energy_joules", "Energy used since gpumon started", 1000000, 1},
+    {"sclk_level", "GFX levels:", "pp_dpm_sclk", false, parse::levels, refresh::tick,
+     bound::none, display::residency, false, "", 1, false, "",
+     "gpumon_sclk_dpm_level", "Current GFX clock DPM level", 1, 1},
+    {"mclk_level", "Mem levels:", "pp_dpm_mclk", false, parse::levels, refresh::tick,
+     bound::none, display::residency, false, "", 1, false, "",
+     "gpumon_mclk_dpm_level", "Current memory clock DPM level", 1, 1},
+};
 
-        m_temp_crit = std::stoull(read_file("hwmon/hwmon1/temp1_crit"));
+static_assert(std::size(metrics) == row_count, "every row needs a metric");
 
-        m_fan_min = std::stoull(read_file("hwmon/hwmon1/fan1_min"));
-        m_fan_max = std::stoull(read_file("hwmon/hwmon1/fan1_max"));
+// Returns the row called name, or row_count if there is none.
+constexpr unsigned find(std::string_view name)
+{
+    unsigned row = 0;
+    while (row < row_count && metrics[row].name != name) {
+        ++row;
     }
+    return row;
+}
 
-    std::pair<std::string, double> busy() const
+// A set of rows, e.g. the enabled ones. The rows in it are also kept as a
+// dense list in row order, so that loops over them on every update only
+// touch the rows in the set.
+class row_set {
+public:
+    // The rows that are on unless disabled.
+    static row_set defaults()
     {
-        auto pc = read_file("gpu_busy_percent");
-        return std::make_pair(pc + '%', std::stod(pc) * 0.01);
+        row_set set;
+        for (unsigned row = 0; row < row_count; ++row) {
+            set.set(row, metrics[row].default_on);
+        }
+        return set;
     }
 
-    std::pair<std::string, double> vram() const
+    static row_set from_mask(std::uint32_t mask)
     {
-        auto used = read_file("mem_info_vram_used");
-        auto u = std::stoull(used);
-        auto pc = static_cast<double>(u) / static_cast<double>(m_vram);
-        u /= 1024ull * 1024ull;
-
-        used = std::to_string(u) + m_vram_str;
-        return std::make_pair(used, pc);
+        row_set set;
+        for (unsigned row = 0; row < row_count; ++row) {
+            set.set(row, mask & (1u << row));
+        }
+        return set;
     }
 
-    std::pair<std::string, double> gtt() const
+    bool test(unsigned row) const
     {
-        auto used = read_file("mem_info_gtt_used");
-        auto u = std::stoull(used);
-        auto pc = static_cast<double>(u) / static_cast<double>(m_gtt);
-        u /= 1024ull * 1024ull;
-
-        used = std::to_string(u) + m_gtt_str;
-        return std::make_pair(used, pc);
+        return m_bits.test(row);
     }
 
-    std::pair<std::string, double> vis_vram() const
+    void set(unsigned row, bool value = true)
     {
-        auto used = read_file("mem_info_vis_vram_used");
-        auto u = std::stoull(used);
-        auto pc = static_cast<double>(u) / static_cast<double>(m_vis_vram);
-        u /= 1024ull * 1024ull;
+        if (m_bits.test(row) == value) {
+            return;
+        }
+        m_bits.set(row, value);
 
-        used = std::to_string(u) + m_vis_vram_str;
-        return std::make_pair(used, pc);
+        m_count = 0;
+        for (unsigned r = 0; r < row_count; ++r) {
+            if (m_bits.test(r)) {
+                m_rows[m_count++] = static_cast<unsigned char>(r);
+            }
+        }
     }
 
-    std::pair<std::string, double> power() const
+    void reset(unsigned row)
     {
-        auto pwr = read_file("hwmon/hwmon1/power1_average");
-        auto p = std::stoull(pwr);
-        auto range = static_cast<double>(m_power_max - m_power_min);
-        auto pc = static_cast<double>(p - m_power_min) / range;
-
-        return std::make_pair(std::to_string(p / 1000000ull) + 'W', pc);
+        set(row, false);
     }
 
-    std::pair<std::string, double> temperature() const
+    size_t size() const
     {
-        auto temp = read_file("hwmon/hwmon1/temp1_input");
-        auto t = std::stoull(temp);
-        auto pc = static_cast<double>(t) / static_cast<double>(m_temp_crit);
-
-        return std::make_pair(std::to_string(t / 1000ull) + 'C', pc);
+        return m_count;
     }
 
-    std::pair<std::string, double> fan() const
+    bool empty() const
     {
-        auto f = read_file("hwmon/hwmon1/fan1_input");
-        auto range = static_cast<double>(m_fan_max - m_fan_min);
-        auto pc = static_cast<double>(std::stod(f) - m_fan_min) / range;
+        return m_count == 0;
+    }
 
-        return std::make_pair(f + "RPM", pc);
+    std::uint32_t mask() const
+    {
+        return static_cast<std::uint32_t>(m_bits.to_ulong());
     }
 
-    std::string voltage() const
+    const unsigned char *begin() const
     {
-        return read_file("hwmon/hwmon1/in0_input") + "mV";
+        return m_rows.data();
     }
 
-    std::string gfx_clock() const
+    const unsigned char *end() const
     {
-        auto freq = read_file("hwmon/hwmon1/freq1_input");
-        auto f = std::stoull(freq);
-        f /= 1000000ull;
-        return std::to_string(f) + "MHz";
+        return m_rows.data() + m_count;
     }
 
-    std::string mem_clock() const
+private:
+    std::bitset<row_count> m_bits;
+    std::array<unsigned char, row_count> m_rows = {};
+    size_t m_count = 0;
+};
+}
+
+using info::row_set;
+
+// A sysfs attribute that is opened once and re-read with pread() from offset
+// zero, which makes the kernel regenerate its contents. The file is reopened
+// only when a read fails, e.g. after the device was unbound and rebound. An
+// attribute that could not be opened at construction is unavailable and is
+// never touched again.
+class sysfs_file {
+public:
+    sysfs_file() = default;
+
+    explicit sysfs_file(std::string path)
+        : m_path(std::move(path))
     {
-        auto freq = read_file("hwmon/hwmon1/freq2_input");
-        auto f = std::stoull(freq);
-        f /= 1000000ull;
-        return std::to_string(f) + "MHz";
+        m_available = open();
     }
 
-    std::string link_speed() const
+    sysfs_file(const sysfs_file &) = delete;
+    sysfs_file &operator=(const sysfs_file &) = delete;
+
+    sysfs_file(sysfs_file &&other) noexcept
+        : m_path(std::move(other.m_path))
+        , m_fd(std::exchange(other.m_fd, -1))
+        , m_available(std::exchange(other.m_available, false))
     {
-        return read_file("current_link_speed");
     }
 
-    std::string link_width() const
+    sysfs_file &operator=(sysfs_file &&other) noexcept
     {
-        return 'x' + read_file("current_link_width");
+        std::swap(m_path, other.m_path);
+        std::swap(m_fd, other.m_fd);
+        std::swap(m_available, other.m_available);
+        return *this;
     }
 
-private:
-    std::string read_file(const std::string_view path) const
+    ~sysfs_file()
     {
-        auto file = m_path;
-        file.append(path);
+        close();
+    }
 
-        std::ifstream input(file);
-        if (!input.is_open()) {
-            return "0";
+    // Reads the first line of the attribute into buf as a null terminated
+    // string and returns its length, or -1 on failure.
+    ssize_t read(char *buf, size_t size) const
+    {
+        auto n = read_raw(buf, size - 1);
+        if (n < 0) {
+            return -1;
         }
 
-        std::string ret;
-        std::getline(input, ret);
-        return ret;
+        auto end = std::find(buf, buf + n, '\n');
+        *end = '\0';
+        return end - buf;
     }
 
-    std::string m_path;
-    std::string m_vram_str;
-    std::string m_gtt_str;
-    std::string m_vis_vram_str;
+    // Reads up to size bytes of the attribute into buf and returns the number
+    // of bytes read, or -1 on failure.
+    ssize_t read_raw(char *buf, size_t size) const
+    {
+        if (!m_available || (m_fd < 0 && !open())) {
+            return -1;
+        }
 
-    using ull = unsigned long long;
+        counters::count_syscall();
+        auto n = pread(m_fd, buf, size, 0);
+        if (n < 0) {
+            close();
+            if (!open()) {
+                return -1;
+            }
+            counters::count_syscall();
+            n = pread(m_fd, buf, size, 0);
+        }
 
-    ull m_vram;
-    ull m_gtt;
-    ull m_vis_vram;
-    ull m_power_min;
-    ull m_power_max;
-    ull m_temp_crit;
-    ull m_fan_min;
-    ull m_fan_max;
-};
+        if (reopen_each_read) {
+            close();
+        }
+        return n;
+    }
 
-void draw_bar(int row, int col, int width, double pc, const std::string &str)
-{
-    move(row, col);
-    clrtoeol();
+    // Makes every read open and close the attribute again, which is how
+    // gpumon used to read sysfs. Only --bench uses it, to compare.
+    static inline bool reopen_each_read = false;
 
-    pc = std::clamp(pc, 0.0, 1.0);
-    width -= 2 + static_cast<int>(str.size());
+    bool available() const
+    {
+        return m_available;
+    }
 
-    auto bars = static_cast<int>(width * pc);
-    if (bars < 0) {
-        return;
+private:
+    bool open() const
+    {
+        counters::count_syscall();
+        m_fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        return m_fd >= 0;
     }
 
-    attron(A_BOLD);
-    addch('[');
-    attroff(A_BOLD);
+    void close() const
+    {
+        if (m_fd >= 0) {
+            counters::count_syscall();
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
 
-    auto bar_color =
-        pc < 0.33 ? color::type::ok :
-        pc < 0.67 ? color::type::warn :
-        color::type::bad;
+    std::string m_path;
+    mutable int m_fd = -1;
+    bool m_available = false;
+};
 
-    std::string bar(static_cast<size_t>(bars), '|');
-    print_string(bar_color, bar);
+std::uint64_t realtime_ms()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000ull +
+        static_cast<std::uint64_t>(ts.tv_nsec) / 1000000ull;
+}
 
-    move(row, col + width + 1);
+std::int64_t monotonic_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::int64_t>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+}
 
-    attron(A_BOLD);
-    print_string(color::type::value, str);
-    addch(']');
-    attroff(A_BOLD);
+bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        auto n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
 }
 
-const int vpad = 1;
-const int hpad = 2;
+// The values of one card at one point in time, indexed by info row and in the
+// units sysfs reports them in: percent, bytes, microwatts, millidegrees
+// Celsius, RPM, millivolts and Hz. The link speed is in MT/s and the link
+// width in lanes.
+struct sample {
+    std::uint64_t time; // milliseconds since the epoch
+    std::uint64_t values[info::row_count];
+    std::uint32_t valid; // one bit per row that was read successfully
 
-namespace info {
-enum {
-    busy,
-    vram,
-    gtt,
-    cpu_vis,
-    power,
-    temperature,
-    fan,
-    voltage,
-    gfx_clock,
-    mem_clock,
-    link_speed,
-    link_width,
+    bool has(unsigned row) const
+    {
+        return valid & (1u << row);
+    }
+};
 
-    row_count
+// The totals and caps that rows are normalized against, read once when the
+// device is constructed.
+struct limits {
+    std::uint64_t vram;
+    std::uint64_t gtt;
+    std::uint64_t vis_vram;
+    std::uint64_t power_min;
+    std::uint64_t power_max;
+    std::uint64_t temp_crit;
+    std::uint64_t fan_min;
+    std::uint64_t fan_max;
 };
 
-#define INFO(x) {#x, x}
+// Where each limit is read from, relative to the device directory or its
+// hwmon node, and how often.
+struct limit_file {
+    std::string_view file;
+    bool hwmon;
+    std::uint64_t limits::*field;
+    info::refresh cadence;
+};
 
-const std::unordered_map<std::string_view, unsigned> info_map = {
-    INFO(busy),
-    INFO(vram),
-    INFO(gtt),
-    INFO(cpu_vis),
-    INFO(power),
-    INFO(temperature),
-    INFO(fan),
-    INFO(voltage),
-    INFO(gfx_clock),
-    INFO(mem_clock),
-    INFO(link_speed),
-    INFO(link_width)
+constexpr limit_file limit_files[] = {
+    {"mem_info_vram_total", false, &limits::vram, info::refresh::fixed},
+    {"mem_info_gtt_total", false, &limits::gtt, info::refresh::fixed},
+    {"mem_info_vis_vram_total", false, &limits::vis_vram, info::refresh::fixed},
+    {"power1_cap_min", true, &limits::power_min, info::refresh::slow},
+    {"power1_cap_max", true, &limits::power_max, info::refresh::slow},
+    {"temp1_crit", true, &limits::temp_crit, info::refresh::slow},
+    {"fan1_min", true, &limits::fan_min, info::refresh::slow},
+    {"fan1_max", true, &limits::fan_max, info::refresh::slow},
 };
-}
 
-void disable_option(std::vector<bool> &enabled_rows, std::string_view option)
+// The values that the bar of a row is empty and full at. Rows without a bar
+// have an empty range.
+std::pair<double, double> bar_range(info::bound normalize, const limits &lim)
 {
-    auto itr = info::info_map.find(option);
-    if (itr != info::info_map.cend()) {
-        enabled_rows[itr->second] = false;
+    using info::bound;
+    switch (normalize) {
+    case bound::none:
+        break;
+    case bound::percent:
+        return {0.0, 100.0};
+    case bound::vram:
+        return {0.0, static_cast<double>(lim.vram)};
+    case bound::gtt:
+        return {0.0, static_cast<double>(lim.gtt)};
+    case bound::vis_vram:
+        return {0.0, static_cast<double>(lim.vis_vram)};
+    case bound::power:
+        return {static_cast<double>(lim.power_min), static_cast<double>(lim.power_max)};
+    case bound::temperature:
+        return {0.0, static_cast<double>(lim.temp_crit)};
+    case bound::fan:
+        return {static_cast<double>(lim.fan_min), static_cast<double>(lim.fan_max)};
     }
+    return {0.0, 0.0};
 }
 
-void disable_options(std::vector<bool> &enabled_rows, std::string_view options)
-{
-    size_t idx = 0;
-    size_t prev_idx = 0;
-    while ((idx = options.find(',', prev_idx)) != std::string_view::npos) {
-        auto opt = options.substr(prev_idx, idx - prev_idx);
-        disable_option(enabled_rows, opt);
-        prev_idx = idx+1;
-    }
+// How rows are read. The automatic backend decodes as many rows as it can from
+// the binary gpu_metrics table with a single read and reads the rest from
+// their own files, like the sysfs backend does for every row. The ioctl
+// backend queries the driver through libdrm instead and is only available if
+// gpumon was built with it.
+enum class backend {
+    automatic,
+    sysfs,
+    gpu_metrics,
+    ioctl
+};
 
-    auto opt = options.substr(prev_idx);
-    disable_option(enabled_rows, opt);
-}
+// A field of the gpu_metrics table of the kernel (struct gpu_metrics_vX_Y in
+// kgd_pp_interface.h) that a row is decoded from. The table starts with a
+// header of its size as a u16 followed by the format and content revisions as
+// u8s. Fields that the firmware does not fill are all ones.
+struct metrics_field {
+    std::uint8_t format;
+    std::uint8_t min_content;
+    std::uint8_t max_content;
+    unsigned row;
+    std::uint16_t offset;
+    std::uint8_t size;
+    std::uint32_t scale; // to the units of struct sample
+};
 
-void draw_labels(const std::vector<bool> &enabled_rows)
-{
-    int row = vpad-1;
+// Format 1 is used by discrete GPUs and reports degrees Celsius and watts,
+// format 2 by APUs with centidegrees and milliwatts. Clocks are in MHz and the
+// link speed in units of 0.1 GT/s. Later revisions of format 1 rearrange the
+// table and are not decoded.
+const metrics_field metrics_fields[] = {
+    {1, 0, 0, info::busy, 28, 2, 1},
+    {1, 0, 0, info::power, 34, 2, 1000000},
+    {1, 0, 0, info::temperature, 16, 2, 1000},
+    {1, 0, 0, info::fan, 72, 2, 1},
+    {1, 0, 0, info::gfx_clock, 54, 2, 1000000},
+    {1, 0, 0, info::mem_clock, 58, 2, 1000000},
+    {1, 0, 0, info::link_width, 74, 1, 1},
+    {1, 0, 0, info::link_speed, 75, 1, 100},
 
-    set_color(color::type::label);
-    if (enabled_rows[info::busy]) mvaddstr(++row, hpad, "GPU busy:");
-    if (enabled_rows[info::vram]) mvaddstr(++row, hpad, "GPU vram:");
-    if (enabled_rows[info::gtt]) mvaddstr(++row, hpad, "GTT:");
-    if (enabled_rows[info::cpu_vis]) mvaddstr(++row, hpad, "CPU Vis:");
-    if (enabled_rows[info::power]) mvaddstr(++row, hpad, "Power draw:");
-    if (enabled_rows[info::temperature]) mvaddstr(++row, hpad, "Temperature:");
-    if (enabled_rows[info::fan]) mvaddstr(++row, hpad, "Fan speed:");
-    if (enabled_rows[info::voltage]) mvaddstr(++row, hpad, "Voltage:");
-    if (enabled_rows[info::gfx_clock]) mvaddstr(++row, hpad, "GFX clock:");
-    if (enabled_rows[info::mem_clock]) mvaddstr(++row, hpad, "Mem clock:");
-    if (enabled_rows[info::link_speed]) mvaddstr(++row, hpad, "Link speed:");
-    if (enabled_rows[info::link_width]) mvaddstr(++row, hpad, "Link width:");
-    remove_color(color::type::label);
-}
+    {1, 1, 3, info::busy, 16, 2, 1},
+    {1, 1, 3, info::power, 22, 2, 1000000},
+    {1, 1, 3, info::temperature, 4, 2, 1000},
+    {1, 1, 3, info::fan, 72, 2, 1},
+    {1, 1, 3, info::gfx_clock, 54, 2, 1000000},
+    {1, 1, 3, info::mem_clock, 58, 2, 1000000},
+    {1, 1, 3, info::link_width, 74, 2, 1},
+    {1, 1, 3, info::link_speed, 76, 2, 100},
+    {1, 3, 3, info::voltage, 106, 2, 1},
 
-void print_help(std::string_view progName)
-{
-    std::cout << "Usage: " << progName << " [options]\n"
-        "Released under the GNU GPLv3\n\n"
-        "  -n, --no-color      disable colors\n"
-        "  -u, --update=N      set automatic updates to N seconds (default 2)\n"
-        "  -h, --help          display this message\n"
-        "  -d, --disable=ROWS  disable each row corresponding to the comma\n"
-        "                      separated list ROWS. Valid options are busy,\n"
-        "                      vram, gtt, cpu_vis, power, temperature, fan,\n"
-        "                      voltage, gfx_clock, mem_clock, link_speed and\n"
-        "                      link_width. Other values are silently ignored.\n";
-}
+    {2, 0, 4, info::busy, 40, 2, 1},
+    {2, 0, 4, info::power, 44, 2, 1000},
+    {2, 0, 4, info::temperature, 16, 2, 10},
+    {2, 0, 4, info::gfx_clock, 80, 2, 1000000},
+    {2, 0, 4, info::mem_clock, 84, 2, 1000000},
+};
 
-void handle_winch(const std::vector<bool> &enabled_rows)
-{
-    winsize w;
-    ioctl(0, TIOCGWINSZ, &w);
-    resizeterm(w.ws_row, w.ws_col);
-    clear();
-    draw_labels(enabled_rows);
-}
+// The largest gpu_metrics table is well below this.
+const size_t max_metrics_size = 1024;
 
-volatile sig_atomic_t should_close = 0;
-volatile sig_atomic_t should_resize = 0;
-void signal_handler(int sig)
+// Decodes the field from a table of size bytes. Returns false if the table is
+// too short or the firmware left the field unset.
+bool decode_metric(const metrics_field &field, const unsigned char *table, size_t size, std::uint64_t &value)
 {
-    switch (sig) {
-    case SIGINT:
-    case SIGTERM:
-        should_close = 1;
+    if (field.offset + field.size > size) {
+        return false;
+    }
+
+    std::uint32_t raw = 0;
+    std::uint32_t unset = 0;
+    switch (field.size) {
+    case 1:
+        raw = table[field.offset];
+        unset = UINT8_MAX;
         break;
-    case SIGWINCH:
-        should_resize = 1;
+    case 2: {
+        std::uint16_t v;
+        std::memcpy(&v, table + field.offset, sizeof(v));
+        raw = v;
+        unset = UINT16_MAX;
         break;
     }
-}
-}
-
-int main(int argc, char **argv)
-{
-    const option options[] = {
-        {"update", required_argument, nullptr, 'u'},
-        {"no-color", no_argument, nullptr, 'n'},
-        {"help", no_argument, nullptr, 'h'},
-        {"disable", required_argument, nullptr, 'd'},
-        {nullptr, 0, nullptr, 0}
-    };
-
-    int sleep_time = 2;
-
-    std::vector<bool> enabled_rows(info::row_count, true);
-
-    int c;
-    while ((c = getopt_long(argc, argv, "hnu:d:", options, nullptr)) != -1) {
-        switch (c) {
-        case 'h':
-            print_help(argv[0]);
-            return EXIT_SUCCESS;
-        case 'n':
-            color::use_color = false;
-            break;
-        case 'u':
-            sleep_time = std::stoi(optarg);
-            break;
-        case 'd':
-            disable_options(enabled_rows, optarg);
-            break;
-        default:
-            return EXIT_FAILURE;
-        }
+    default:
+        std::memcpy(&raw, table + field.offset, sizeof(raw));
+        unset = UINT32_MAX;
+        break;
     }
 
-    if (std::all_of(enabled_rows.cbegin(), enabled_rows.cend(), [](auto b){return !b;})) {
-        std::cout << "All rows disabled. Exiting." << std::endl;
-        return EXIT_SUCCESS;
+    if (raw == unset) {
+        return false;
     }
+    value = static_cast<std::uint64_t>(raw) * field.scale;
+    return true;
+}
 
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    signal(SIGWINCH, signal_handler);
-
-    initscr();
+#ifdef GPUMON_HAVE_LIBDRM
+// Queries the sensors and memory usage of a card with AMDGPU_INFO ioctls on
+// its render node, which skips formatting and parsing text altogether.
+class drm_device {
+public:
+    drm_device() = default;
 
-    timeout(sleep_time*1000);
-    noecho();
-    curs_set(0);
-    keypad(stdscr, true);
-    clear();
+    drm_device(const drm_device &) = delete;
+    drm_device &operator=(const drm_device &) = delete;
 
-    color::use_color &= has_colors();
+    drm_device(drm_device &&other) noexcept
+        : m_handle(std::exchange(other.m_handle, nullptr))
+    {
+    }
 
-    if (color::use_color) {
-        start_color();
-        use_default_colors();
-        init_pair(static_cast<int>(color::type::label), COLOR_CYAN, -1);
-        init_pair(static_cast<int>(color::type::value), COLOR_BLACK, -1);
-        init_pair(static_cast<int>(color::type::ok), COLOR_GREEN, -1);
-        init_pair(static_cast<int>(color::type::warn), COLOR_YELLOW, -1);
-        init_pair(static_cast<int>(color::type::bad), COLOR_RED, -1);
+    drm_device &operator=(drm_device &&other) noexcept
+    {
+        std::swap(m_handle, other.m_handle);
+        return *this;
     }
 
-    draw_labels(enabled_rows);
+    ~drm_device()
+    {
+        if (m_handle) {
+            amdgpu_device_deinitialize(m_handle);
+        }
+    }
 
-    const auto text_len = 13 + hpad;
+    // Opens the render node of the card at device_path, the device/ directory
+    // of the card in sysfs.
+    bool open(const std::string &device_path)
+    {
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(device_path + "drm", ec)) {
+            auto name = entry.path().filename().string();
+            if (name.compare(0, 7, "renderD") != 0) {
+                continue;
+            }
 
-    const device dev("/sys/class/drm/card0/device/");
+            int fd = ::open(("/dev/dri/" + name).c_str(), O_RDWR | O_CLOEXEC);
+            if (fd < 0) {
+                return false;
+            }
 
-    while (!should_close) {
-        if (should_resize) {
-            handle_winch(enabled_rows);
-            should_resize = 0;
+            // libdrm keeps a duplicate of the fd.
+            std::uint32_t major, minor;
+            bool ok = amdgpu_device_initialize(fd, &major, &minor, &m_handle) == 0;
+            ::close(fd);
+            if (!ok) {
+                m_handle = nullptr;
+            }
+            return ok;
         }
+        return false;
+    }
 
-        int bar_width = COLS - text_len - hpad;
-        int row = vpad-1;
+    // Whether the row can be queried at all. Rows that are not queried by
+    // ioctl are false.
+    bool supports(unsigned row) const
+    {
+        std::uint64_t value;
+        return m_handle && read(row, value);
+    }
 
-        if (enabled_rows[info::busy]) {
-            auto [busy, busy_pc] = dev.busy();
-            draw_bar(++row, text_len, bar_width, busy_pc, busy);
+    bool read(unsigned row, std::uint64_t &value) const
+    {
+        switch (row) {
+        case info::busy:
+            return sensor(AMDGPU_INFO_SENSOR_GPU_LOAD, 1, value);
+        case info::vram:
+            return query(AMDGPU_INFO_VRAM_USAGE, value);
+        case info::gtt:
+            return query(AMDGPU_INFO_GTT_USAGE, value);
+        case info::cpu_vis:
+            return query(AMDGPU_INFO_VIS_VRAM_USAGE, value);
+        case info::power:
+            return sensor(AMDGPU_INFO_SENSOR_GPU_AVG_POWER, 1000000, value);
+        case info::temperature:
+            return sensor(AMDGPU_INFO_SENSOR_GPU_TEMP, 1, value);
+        case info::voltage:
+            return sensor(AMDGPU_INFO_SENSOR_VDDGFX, 1, value);
+        case info::gfx_clock:
+            return sensor(AMDGPU_INFO_SENSOR_GFX_SCLK, 1000000, value);
+        case info::mem_clock:
+            return sensor(AMDGPU_INFO_SENSOR_GFX_MCLK, 1000000, value);
+        default:
+            return false;
         }
+    }
 
-        if (enabled_rows[info::vram]) {
-            auto [mem, mem_pc] = dev.vram();
-            draw_bar(++row, text_len, bar_width, mem_pc, mem);
+private:
+    // Sensors report 32 bit values: percent, watts, millidegrees, millivolts
+    // and MHz. scale converts them to the units of struct sample.
+    bool sensor(unsigned type, std::uint64_t scale, std::uint64_t &value) const
+    {
+        std::uint32_t raw;
+        counters::count_syscall();
+        if (amdgpu_query_sensor_info(m_handle, type, sizeof(raw), &raw) != 0) {
+            return false;
         }
+        value = raw * scale;
+        return true;
+    }
 
-        if (enabled_rows[info::gtt]) {
-            auto [gtt, gtt_pc] = dev.gtt();
-            draw_bar(++row, text_len, bar_width, gtt_pc, gtt);
-        }
+    bool query(unsigned id, std::uint64_t &value) const
+    {
+        counters::count_syscall();
+        return amdgpu_query_info(m_handle, id, sizeof(value), &value) == 0;
+    }
 
-        if (enabled_rows[info::cpu_vis]) {
-            auto [vis, vis_pc] = dev.vis_vram();
-            draw_bar(++row, text_len, bar_width, vis_pc, vis);
-        }
+    amdgpu_device_handle m_handle = nullptr;
+};
+#endif
 
-        if (enabled_rows[info::power]) {
-            auto [pwr, pwr_pc] = dev.power();
-            draw_bar(++row, text_len, bar_width, pwr_pc, pwr);
+// Parses the contents of the file of a row from first to last, see
+// info::parse.
+bool parse_value(info::parse format, const char *first, const char *last, std::uint64_t &value)
+{
+    switch (format) {
+    case info::parse::integer: {
+        auto [ptr, ec] = std::from_chars(first, last, value);
+        return ec == std::errc();
+    }
+    case info::parse::decimal: {
+        double decimal;
+        auto [ptr, ec] = std::from_chars(first, last, decimal);
+        if (ec != std::errc() || !(decimal >= 0.0 && decimal < 1e15)) {
+            return false;
         }
-
-        if (enabled_rows[info::temperature]) {
-            auto [temp, temp_pc] = dev.temperature();
-            draw_bar(++row, text_len, bar_width, temp_pc, temp);
+        value = static_cast<std::uint64_t>(decimal * 1000.0 + 0.5);
+        return true;
+    }
+    case info::parse::counts: {
+        std::uint64_t counts[3];
+        for (auto &count : counts) {
+            while (first < last && *first == ' ') {
+                ++first;
+            }
+            auto [ptr, ec] = std::from_chars(first, last, count);
+            if (ec != std::errc()) {
+                return false;
+            }
+            first = ptr;
         }
-
-        if (enabled_rows[info::fan]) {
-            auto [fan, fan_pc] = dev.fan();
-            draw_bar(++row, text_len, bar_width, fan_pc, fan);
+        value = (counts[0] + counts[1]) * counts[2];
+        return true;
+    }
+    case info::parse::levels:
+        for (std::uint64_t level = 0; first < last; ++level) {
+            auto end = std::find(first, last, '\n');
+            if (std::find(first, end, '*') != end) {
+                value = level;
+                return true;
+            }
+            first = end == last ? last : end + 1;
         }
+        return false;
+    }
+    return false;
+}
 
-        if (enabled_rows[info::voltage]) {
-            move(++row, text_len);
-            clrtoeol();
-            print_string(color::type::label, dev.voltage(), A_BOLD);
+class device {
+public:
+    device(std::string_view name, std::string_view path, backend source = backend::automatic)
+        : m_name(name)
+        , m_path(path)
+        , m_hwmon(find_hwmon())
+        , m_pci_slot(find_pci_slot())
+    {
+        // Only the files of limits that are read again are kept open.
+        for (size_t i = 0; i < std::size(limit_files); ++i) {
+            const auto &limit = limit_files[i];
+            auto file = limit.hwmon ? open_hwmon_file(limit.file) : open_file(limit.file);
+            read_number(file, m_limits.*limit.field);
+            if (limit.cadence != info::refresh::fixed) {
+                m_limit_files[i] = std::move(file);
+            }
         }
 
-        if (enabled_rows[info::gfx_clock]) {
-            move(++row, text_len);
-            clrtoeol();
-            print_string(color::type::label, dev.gfx_clock(), A_BOLD);
+        for (unsigned row = 0; row < info::row_count; ++row) {
+            const auto &metric = info::metrics[row];
+            m_files[row] = metric.hwmon ? open_hwmon_file(metric.file) : open_file(metric.file);
         }
 
-        if (enabled_rows[info::mem_clock]) {
-            move(++row, text_len);
-            clrtoeol();
-            print_string(color::type::label, dev.mem_clock(), A_BOLD);
+        if (source == backend::automatic || source == backend::gpu_metrics) {
+            find_metrics();
+        }
+#ifdef GPUMON_HAVE_LIBDRM
+        if (source == backend::ioctl && m_drm.open(m_path)) {
+            for (unsigned row = 0; row < info::row_count; ++row) {
+                m_ioctl_rows[row] = m_drm.supports(row);
+            }
         }
+#endif
 
-        if (enabled_rows[info::link_speed]) {
-            move(++row, text_len);
-            clrtoeol();
-            print_string(color::type::label, dev.link_speed(), A_BOLD);
+        // A bar needs a range to be drawn against.
+        for (unsigned row = 0; row < info::row_count; ++row) {
+            auto normalize = info::metrics[row].normalize;
+            auto [low, high] = bar_range(normalize, m_limits);
+            m_supported.set(row, readable(row) && (normalize == info::bound::none || high > low));
         }
+        m_sampled = m_supported;
 
-        if (enabled_rows[info::link_width]) {
-            move(++row, text_len);
-            clrtoeol();
-            print_string(color::type::label, dev.link_width(), A_BOLD);
+        // Without an energy counter, the energy used is integrated from the
+        // power draw instead, see rate_stage.
+        if (m_supported.test(info::power)) {
+            m_supported.set(info::energy);
         }
+    }
 
-        refresh();
+    // A device that only describes a card, e.g. one from a recording, and
+    // must not be sampled.
+    device(std::string_view name, const struct limits &lim, std::uint32_t supported)
+        : m_name(name)
+        , m_limits(lim)
+        , m_supported(row_set::from_mask(supported))
+    {
+    }
+
+    // Whether the row can be shown for this card.
+    bool supports(unsigned row) const
+    {
+        return m_supported.test(row);
+    }
+
+    // Whether any row is decoded from the gpu_metrics table.
+    bool uses_metrics() const
+    {
+        return std::any_of(m_metrics_fields.cbegin(), m_metrics_fields.cend(), [](auto f){return f;});
+    }
+
+    // Whether any row is queried by ioctl.
+    bool uses_ioctl() const
+    {
+        return std::any_of(m_ioctl_rows.cbegin(), m_ioctl_rows.cend(), [](auto b){return b;});
+    }
+
+    // Reads every row of rows that is supported into out. Rows decoded from
+    // the gpu_metrics table all come from the same single read of it. Slow
+    // rows are taken from the values cached by the last sample that read
+    // them, unless those are older than slow_refresh.
+    void sample(struct sample &out, const row_set &rows) const
+    {
+        out.time = realtime_ms();
+        out.valid = 0;
+
+        auto now = monotonic_ns();
+        bool refresh_slow = !m_slow_read || now - m_slow_time >= info::slow_refresh;
+        bool read_slow = false;
+
+        unsigned char table[max_metrics_size];
+        ssize_t table_size = -1;
+        bool table_read = false;
+
+        for (unsigned row : rows) {
+            // Without an energy counter, the power draw is read in its place.
+            if (row == info::energy && !m_sampled.test(row) && !rows.test(info::power)) {
+                row = info::power;
+            }
+            if (!m_sampled.test(row)) {
+                continue;
+            }
+
+            bool slow = info::metrics[row].cadence == info::refresh::slow;
+            if (slow && !refresh_slow) {
+                out.values[row] = m_slow.values[row];
+                out.valid |= m_slow.valid & (1u << row);
+                continue;
+            }
+
+            bool ok;
+            if (m_metrics_fields[row]) {
+                if (!table_read) {
+                    table_size = m_metrics.read_raw(reinterpret_cast<char *>(table), sizeof(table));
+                    table_read = true;
+                }
+                ok = table_size > 0 && decode_metric(*m_metrics_fields[row], table,
+                                                     static_cast<size_t>(table_size), out.values[row]);
+#ifdef GPUMON_HAVE_LIBDRM
+            } else if (m_ioctl_rows[row]) {
+                ok = m_drm.read(row, out.values[row]);
+#endif
+            } else {
+                ok = read_value(row, out.values[row]);
+            }
+
+            if (ok) {
+                out.valid |= 1u << row;
+            }
+            if (slow) {
+                m_slow.values[row] = out.values[row];
+                m_slow.valid = (m_slow.valid & ~(1u << row)) | (out.valid & (1u << row));
+                read_slow = true;
+            }
+        }
+
+        if (read_slow) {
+            m_slow_read = true;
+            m_slow_time = now;
+        }
+    }
+
+    // The limits as read when the device was constructed. Sampled frames
+    // carry their current values, see refresh_limits().
+    const struct limits &limits() const
+    {
+        return m_limits;
+    }
+
+    // Reads the limits that can change at runtime, e.g. the power cap, into
+    // lim again.
+    void refresh_limits(struct limits &lim) const
+    {
+        for (size_t i = 0; i < std::size(limit_files); ++i) {
+            read_number(m_limit_files[i], lim.*limit_files[i].field);
+        }
+    }
+
+    const std::string &name() const
+    {
+        return m_name;
+    }
+
+    // The PCI slot of the card, e.g. "0000:03:00.0", as fdinfo reports it.
+    const std::string &pci_slot() const
+    {
+        return m_pci_slot;
+    }
+
+private:
+    bool readable(unsigned row) const
+    {
+        return m_metrics_fields[row] || m_ioctl_rows[row] || m_files[row].available();
+    }
+
+    // Picks the rows that are read from gpu_metrics if the card has a table in
+    // a format gpumon knows. A row is only taken from the table if the
+    // firmware fills its field, and is read from its file otherwise.
+    void find_metrics()
+    {
+        m_metrics = open_file("gpu_metrics");
+
+        unsigned char table[max_metrics_size];
+        auto n = m_metrics.read_raw(reinterpret_cast<char *>(table), sizeof(table));
+        if (n < 4) {
+            m_metrics = {};
+            return;
+        }
+
+        auto size = static_cast<size_t>(n);
+        auto format = table[2];
+        auto content = table[3];
+        for (const auto &field : metrics_fields) {
+            std::uint64_t value;
+            if (field.format != format || content < field.min_content || content > field.max_content ||
+                !decode_metric(field, table, size, value)) {
+                continue;
+            }
+            // A zero link width or speed means the firmware does not report it.
+            if ((field.row == info::link_speed || field.row == info::link_width) && value == 0) {
+                continue;
+            }
+            m_metrics_fields[field.row] = &field;
+        }
+    }
+
+    // The device directory of a card links to its PCI device.
+    std::string find_pci_slot() const
+    {
+        std::error_code ec;
+        auto target = std::filesystem::canonical(m_path, ec);
+        return ec ? std::string() : target.filename().string();
+    }
+
+    // Returns the hwmon node of the device relative to m_path, e.g.
+    // "hwmon/hwmon3/", or an empty string if it has none.
+    std::string find_hwmon() const
+    {
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(m_path + "hwmon", ec)) {
+            auto name = entry.path().filename().string();
+            if (name.compare(0, 5, "hwmon") == 0) {
+                return "hwmon/" + name + '/';
+            }
+        }
+        return {};
+    }
+
+    sysfs_file open_file(std::string_view path) const
+    {
+        auto file = m_path;
+        file.append(path);
+        return sysfs_file(std::move(file));
+    }
+
+    sysfs_file open_hwmon_file(std::string_view name) const
+    {
+        if (m_hwmon.empty()) {
+            return {};
+        }
+
+        auto file = m_hwmon;
+        file.append(name);
+        return open_file(file);
+    }
+
+    // Leaves value alone if the file cannot be read.
+    static void read_number(const sysfs_file &file, std::uint64_t &value)
+    {
+        char buf[64];
+        auto n = file.read(buf, sizeof(buf));
+        if (n > 0) {
+            std::from_chars(buf, buf + n, value);
+        }
+    }
+
+    // DPM tables span several lines, every other file is read up to its
+    // first one.
+    bool read_value(unsigned row, std::uint64_t &value) const
+    {
+        char buf[512];
+        auto format = info::metrics[row].format;
+        auto n = format == info::parse::levels ? m_files[row].read_raw(buf, sizeof(buf)) :
+            m_files[row].read(buf, 64);
+        return n > 0 && parse_value(format, buf, buf + n, value);
+    }
+
+    std::string m_name;
+    std::string m_path;
+    std::string m_hwmon;
+    std::string m_pci_slot;
+
+    struct limits m_limits = {};
+    std::array<sysfs_file, std::size(limit_files)> m_limit_files;
+
+    // The slow rows as last read. A device is only sampled by one thread at
+    // a time.
+    mutable struct sample m_slow = {};
+    mutable bool m_slow_read = false;
+    mutable std::int64_t m_slow_time = 0;
+    std::array<sysfs_file, info::row_count> m_files;
+    row_set m_supported;
+    row_set m_sampled;
+
+    sysfs_file m_metrics;
+    std::array<const metrics_field *, info::row_count> m_metrics_fields = {};
+
+#ifdef GPUMON_HAVE_LIBDRM
+    drm_device m_drm;
+#endif
+    std::array<bool, info::row_count> m_ioctl_rows = {};
+};
+
+// Returns the names of all amdgpu cards under root, e.g. "card0", in index
+// order. Connector nodes such as card0-DP-1 and cards bound to other drivers
+// are skipped.
+std::vector<std::string> find_cards(const std::filesystem::path &root)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<std::pair<unsigned long, std::string>> cards;
+
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(root, ec)) {
+        auto name = entry.path().filename().string();
+        if (name.size() <= 4 || name.compare(0, 4, "card") != 0 ||
+            !std::all_of(name.cbegin() + 4, name.cend(), ::isdigit)) {
+            continue;
+        }
+
+        auto driver = fs::read_symlink(entry.path() / "device" / "driver", ec);
+        if (ec || driver.filename() != "amdgpu") {
+            continue;
+        }
+
+        cards.emplace_back(std::stoul(name.substr(4)), std::move(name));
+    }
+
+    std::sort(cards.begin(), cards.end());
+
+    std::vector<std::string> ret;
+    for (auto &card : cards) {
+        ret.push_back(std::move(card.second));
+    }
+    return ret;
+}
+
+// A fixed set of threads that run a job for every index in [0, count) in
+// parallel. The calling thread takes index 0 itself, so a pool for a single
+// device never starts a thread. The threads block every signal.
+class worker_pool {
+public:
+    explicit worker_pool(size_t count)
+    {
+        for (size_t i = 1; i < count; ++i) {
+            m_threads.emplace_back([this, i]{ work(i); });
+        }
+    }
+
+    worker_pool(const worker_pool &) = delete;
+    worker_pool &operator=(const worker_pool &) = delete;
+
+    ~worker_pool()
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+        m_start.notify_all();
+
+        for (auto &thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    void run(const std::function<void(size_t)> &job)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_job = &job;
+            m_pending = m_threads.size();
+            ++m_generation;
+        }
+        m_start.notify_all();
+
+        job(0);
+
+        std::unique_lock lock(m_mutex);
+        m_done.wait(lock, [this]{ return m_pending == 0; });
+        m_job = nullptr;
+    }
+
+private:
+    void work(size_t idx)
+    {
+        // Signals are left to the threads that handle them, whenever the
+        // pool was created.
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        unsigned long generation = 0;
+        while (true) {
+            const std::function<void(size_t)> *job;
+            {
+                std::unique_lock lock(m_mutex);
+                m_start.wait(lock, [&]{ return m_stop || m_generation != generation; });
+                if (m_stop) {
+                    return;
+                }
+                generation = m_generation;
+                job = m_job;
+            }
+
+            (*job)(idx);
+
+            std::lock_guard lock(m_mutex);
+            if (--m_pending == 0) {
+                m_done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    const std::function<void(size_t)> *m_job = nullptr;
+    unsigned long m_generation = 0;
+    size_t m_pending = 0;
+    bool m_stop = false;
+};
+
+// A minimal epoll based event loop that calls the handler registered for a
+// file descriptor whenever it becomes ready.
+class event_loop {
+public:
+    using handler = std::function<void(std::uint32_t events)>;
+
+    event_loop()
+        : m_epoll(epoll_create1(EPOLL_CLOEXEC))
+    {
+    }
+
+    event_loop(const event_loop &) = delete;
+    event_loop &operator=(const event_loop &) = delete;
+
+    ~event_loop()
+    {
+        ::close(m_epoll);
+    }
+
+    bool add(int fd, std::uint32_t events, handler h)
+    {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return false;
+        }
+        m_handlers[fd] = std::make_unique<handler>(std::move(h));
+        return true;
+    }
+
+    void modify(int fd, std::uint32_t events)
+    {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    // Handlers may remove any file descriptor, including their own.
+    void remove(int fd)
+    {
+        auto itr = m_handlers.find(fd);
+        if (itr == m_handlers.end()) {
+            return;
+        }
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        m_removed.push_back(std::move(itr->second));
+        m_handlers.erase(itr);
+    }
+
+    // Dispatches events until stop() is called.
+    void run()
+    {
+        epoll_event events[64];
+
+        m_stop = false;
+        while (!m_stop) {
+            auto n = epoll_wait(m_epoll, events, 64, -1);
+            if (n < 0 && errno != EINTR) {
+                return;
+            }
+
+            for (int i = 0; i < n && !m_stop; ++i) {
+                auto itr = m_handlers.find(events[i].data.fd);
+                if (itr != m_handlers.end()) {
+                    (*itr->second)(events[i].events);
+                }
+            }
+            m_removed.clear();
+        }
+    }
+
+    void stop()
+    {
+        m_stop = true;
+    }
+
+private:
+    int m_epoll;
+    std::unordered_map<int, std::unique_ptr<handler>> m_handlers;
+    std::vector<std::unique_ptr<handler>> m_removed;
+    bool m_stop = false;
+};
+
+// Intervals are clamped to this, so that an interval of zero updates as often
+// as is sensible rather than disarming the timer.
+const std::int64_t min_interval = 1000000ll;
+
+// A timerfd that expires at fixed CLOCK_MONOTONIC deadlines, so the period
+// does not grow by however long sampling and drawing take. Deadlines missed
+// while busy are coalesced into a single expiry.
+class timer_fd {
+public:
+    timer_fd()
+        : m_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    {
+    }
+
+    timer_fd(const timer_fd &) = delete;
+    timer_fd &operator=(const timer_fd &) = delete;
+
+    ~timer_fd()
+    {
+        ::close(m_fd);
+    }
+
+    // A period of zero or less disarms the timer.
+    void set_period(std::int64_t period_ns)
+    {
+        itimerspec spec = {};
+        if (period_ns > 0) {
+            spec.it_interval = to_timespec(period_ns);
+            spec.it_value = to_timespec(monotonic_ns() + period_ns);
+        }
+        timerfd_settime(m_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    // Returns the number of expiries since the last call.
+    std::uint64_t read() const
+    {
+        std::uint64_t expiries = 0;
+        if (::read(m_fd, &expiries, sizeof(expiries)) != sizeof(expiries)) {
+            return 0;
+        }
+        return expiries;
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+private:
+    static timespec to_timespec(std::int64_t ns)
+    {
+        return {static_cast<time_t>(ns / 1000000000ll), static_cast<long>(ns % 1000000000ll)};
+    }
+
+    int m_fd;
+};
+
+// Blocks the given signals in the calling thread, and in every thread it
+// creates afterwards, and delivers them through a signalfd instead.
+class signal_fd {
+public:
+    explicit signal_fd(std::initializer_list<int> signals)
+    {
+        sigemptyset(&m_mask);
+        for (auto sig : signals) {
+            sigaddset(&m_mask, sig);
+        }
+        pthread_sigmask(SIG_BLOCK, &m_mask, nullptr);
+        m_fd = signalfd(-1, &m_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
+
+    signal_fd(const signal_fd &) = delete;
+    signal_fd &operator=(const signal_fd &) = delete;
+
+    ~signal_fd()
+    {
+        ::close(m_fd);
+        pthread_sigmask(SIG_UNBLOCK, &m_mask, nullptr);
+    }
+
+    // Returns the next pending signal, or 0 if there is none.
+    int read() const
+    {
+        signalfd_siginfo info;
+        if (::read(m_fd, &info, sizeof(info)) != sizeof(info)) {
+            return 0;
+        }
+        return static_cast<int>(info.ssi_signo);
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+private:
+    sigset_t m_mask;
+    int m_fd;
+};
+
+struct bar_shape {
+    int length;
+    color::type color;
+
+    bool operator==(const bar_shape &other) const
+    {
+        return length == other.length && color == other.color;
+    }
+};
+
+// The bar does not fit if its length is negative.
+bar_shape shape_bar(int width, double pc, std::string_view str)
+{
+    pc = std::clamp(pc, 0.0, 1.0);
+    width -= 2 + static_cast<int>(str.size());
+
+    auto bar_color =
+        pc < 0.33 ? color::type::ok :
+        pc < 0.67 ? color::type::warn :
+        color::type::bad;
+
+    return {width < 0 ? -1 : static_cast<int>(width * pc), bar_color};
+}
+
+// An eventfd used to wake up another thread's event loop.
+class event_fd {
+public:
+    event_fd()
+        : m_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+    }
+
+    event_fd(const event_fd &) = delete;
+    event_fd &operator=(const event_fd &) = delete;
+
+    ~event_fd()
+    {
+        ::close(m_fd);
+    }
+
+    void notify() const
+    {
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(m_fd, &one, sizeof(one));
+    }
+
+    void drain() const
+    {
+        std::uint64_t count;
+        [[maybe_unused]] auto n = ::read(m_fd, &count, sizeof(count));
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+private:
+    int m_fd;
+};
+
+// A lock-free single-producer single-consumer slot that always holds the
+// newest value published. The producer fills back() and swaps it with the
+// middle buffer, and the consumer swaps the middle buffer with its front one
+// when it is newer, so neither side ever waits for the other or sees a
+// partially written value.
+template <typename T>
+class triple_buffer {
+public:
+    explicit triple_buffer(const T &initial)
+        : m_buffers{initial, initial, initial}
+    {
+    }
+
+    T &back()
+    {
+        return m_buffers[m_back];
+    }
+
+    void publish()
+    {
+        auto prev = m_middle.exchange(m_back | fresh, std::memory_order_acq_rel);
+        m_back = prev & ~fresh;
+    }
+
+    // Makes the newest published value the front one. Returns false if
+    // nothing was published since the last call.
+    bool update()
+    {
+        if (!(m_middle.load(std::memory_order_relaxed) & fresh)) {
+            return false;
+        }
+        auto prev = m_middle.exchange(m_front, std::memory_order_acq_rel);
+        m_front = prev & ~fresh;
+        return true;
+    }
+
+    const T &front() const
+    {
+        return m_buffers[m_front];
+    }
+
+private:
+    static constexpr unsigned fresh = 4;
+
+    std::array<T, 3> m_buffers;
+    unsigned m_back = 0;
+    std::atomic<unsigned> m_middle = 1;
+    unsigned m_front = 2;
+};
+
+// Estimates a quantile of a stream in constant space with the P-square
+// algorithm of Jain and Chlamtac. The estimate is poor for short streams, so
+// the first exact_count values are also kept and the quantile is exact until
+// there are more.
+class p2_quantile {
+public:
+    explicit p2_quantile(double p)
+        : m_p(p)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        m_count = 0;
+        m_increments = {0.0, m_p / 2.0, m_p, (1.0 + m_p) / 2.0, 1.0};
+    }
+
+    void add(double x)
+    {
+        if (m_count < exact_count) {
+            m_exact[m_count] = x;
+        }
+
+        if (m_count < 5) {
+            m_heights[m_count++] = x;
+            if (m_count == 5) {
+                std::sort(m_heights.begin(), m_heights.end());
+                m_positions = {0.0, 1.0, 2.0, 3.0, 4.0};
+                m_desired = {0.0, 2.0 * m_p, 4.0 * m_p, 2.0 + 2.0 * m_p, 4.0};
+            }
+            return;
+        }
+
+        size_t k;
+        if (x < m_heights[0]) {
+            m_heights[0] = x;
+            k = 0;
+        } else if (x >= m_heights[4]) {
+            m_heights[4] = x;
+            k = 3;
+        } else {
+            k = 0;
+            while (x >= m_heights[k + 1]) {
+                ++k;
+            }
+        }
+
+        for (size_t i = k + 1; i < 5; ++i) {
+            m_positions[i] += 1.0;
+        }
+        for (size_t i = 0; i < 5; ++i) {
+            m_desired[i] += m_increments[i];
+        }
+
+        for (size_t i = 1; i < 4; ++i) {
+            auto d = m_desired[i] - m_positions[i];
+            if ((d >= 1.0 && m_positions[i + 1] - m_positions[i] > 1.0) ||
+                (d <= -1.0 && m_positions[i - 1] - m_positions[i] < -1.0)) {
+                auto sign = d >= 0.0 ? 1.0 : -1.0;
+                auto height = parabolic(i, sign);
+                if (m_heights[i - 1] < height && height < m_heights[i + 1]) {
+                    m_heights[i] = height;
+                } else {
+                    m_heights[i] = linear(i, sign);
+                }
+                m_positions[i] += sign;
+            }
+        }
+        ++m_count;
+    }
+
+    double value() const
+    {
+        if (m_count > exact_count) {
+            return m_heights[2];
+        }
+        if (m_count == 0) {
+            return 0.0;
+        }
+
+        auto sorted = m_exact;
+        auto nth = sorted.begin() + static_cast<std::ptrdiff_t>(m_p * static_cast<double>(m_count - 1) + 0.5);
+        std::nth_element(sorted.begin(), nth, sorted.begin() + static_cast<std::ptrdiff_t>(m_count));
+        return *nth;
+    }
+
+private:
+    double parabolic(size_t i, double d) const
+    {
+        const auto &q = m_heights;
+        const auto &n = m_positions;
+        return q[i] + d / (n[i + 1] - n[i - 1]) *
+            ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+             (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+    }
+
+    double linear(size_t i, double d) const
+    {
+        auto j = d > 0.0 ? i + 1 : i - 1;
+        return m_heights[i] + d * (m_heights[j] - m_heights[i]) / (m_positions[j] - m_positions[i]);
+    }
+
+    static constexpr size_t exact_count = 64;
+
+    double m_p;
+    size_t m_count = 0;
+    std::array<double, exact_count> m_exact;
+    std::array<double, 5> m_heights = {};
+    std::array<double, 5> m_positions = {};
+    std::array<double, 5> m_desired = {};
+    std::array<double, 5> m_increments = {};
+};
+
+// The rows that are read at the oversampling rate, and summarized per update.
+const unsigned oversampled_rows[] = {info::busy, info::power, info::gfx_clock, info::mem_clock};
+const size_t oversampled_count = std::size(oversampled_rows);
+
+int oversampled_index(unsigned row)
+{
+    auto itr = std::find(std::begin(oversampled_rows), std::end(oversampled_rows), row);
+    return itr == std::end(oversampled_rows) ? -1 : static_cast<int>(itr - std::begin(oversampled_rows));
+}
+
+struct summary {
+    std::uint64_t min;
+    std::uint64_t mean;
+    std::uint64_t max;
+    std::uint64_t p95;
+};
+
+// The summaries of the oversampled rows of one card over one update
+// interval, indexed like oversampled_rows.
+struct aggregate {
+    std::uint32_t counts[oversampled_count]; // 0 if the row has no summary
+    summary rows[oversampled_count];
+};
+
+// Running min/mean/max/p95 of one row with constant state.
+class running_stats {
+public:
+    void add(double x)
+    {
+        m_min = m_count == 0 ? x : std::min(m_min, x);
+        m_max = m_count == 0 ? x : std::max(m_max, x);
+        m_sum += x;
+        m_p95.add(x);
+        ++m_count;
+    }
+
+    // Writes the summary to out and starts over.
+    std::uint32_t take(summary &out)
+    {
+        auto count = m_count;
+        if (count > 0) {
+            out.min = static_cast<std::uint64_t>(m_min);
+            out.mean = static_cast<std::uint64_t>(m_sum / static_cast<double>(count) + 0.5);
+            out.max = static_cast<std::uint64_t>(m_max);
+            out.p95 = static_cast<std::uint64_t>(m_p95.value() + 0.5);
+        }
+
+        m_count = 0;
+        m_sum = 0.0;
+        m_p95.reset();
+        return count;
+    }
+
+private:
+    std::uint32_t m_count = 0;
+    double m_min = 0.0;
+    double m_max = 0.0;
+    double m_sum = 0.0;
+    p2_quantile m_p95{0.95};
+};
+
+// The engines of the process panel. fdinfo engines with other names, e.g.
+// dec, enc or jpeg, are added up as media.
+const std::string_view engine_names[] = {"gfx", "compute", "dma"};
+const size_t engine_count = std::size(engine_names) + 1;
+
+// The GPU usage of one process on one card over the last update.
+struct process_usage {
+    std::int32_t pid;
+    std::uint32_t card;
+    char name[16];
+    std::uint32_t engines[engine_count]; // permille of the time since the last update
+    std::uint64_t vram; // bytes
+    std::uint64_t gtt;
+};
+
+const size_t max_processes = 32;
+
+// The processes using the GPUs the most, busiest first.
+struct process_table {
+    std::uint32_t count = 0;
+    std::array<process_usage, max_processes> rows;
+};
+
+// Finds the processes that have amdgpu devices open and reads their usage
+// from the drm-* keys of /proc/<pid>/fdinfo/<fd>. Walking all of /proc is
+// expensive on a busy host, so it only happens every walk_interval, and then
+// only the fd directories of new processes and of those not looked at for
+// rescan_interval are walked. The fd numbers of GPU files are remembered and
+// their fdinfo read on every update. fdinfo files are opened for each read
+// rather than kept open, so that many clients cannot use up gpumon's file
+// descriptors, and /proc is read with plain system calls that do not count
+// as sensor reads.
+class process_scanner {
+public:
+    explicit process_scanner(const std::vector<device> &devices)
+    {
+        for (const auto &dev : devices) {
+            m_slots.push_back(dev.pci_slot());
+        }
+    }
+
+    void update(process_table &out)
+    {
+        auto now = monotonic_ns();
+        if (now - m_last_walk >= walk_interval) {
+            walk(now);
+            m_last_walk = now;
+        }
+
+        m_usage.clear();
+        ++m_generation;
+        for (auto &[pid, proc] : m_processes) {
+            read_process(pid, proc, now);
+        }
+
+        for (auto itr = m_clients.begin(); itr != m_clients.end();) {
+            itr = itr->second.generation == m_generation ? std::next(itr) : m_clients.erase(itr);
+        }
+
+        auto count = std::min(m_usage.size(), max_processes);
+        std::partial_sort(m_usage.begin(), m_usage.begin() + static_cast<std::ptrdiff_t>(count), m_usage.end(),
+                          [](const process_usage &a, const process_usage &b){
+            return std::make_pair(busy(a), a.vram) > std::make_pair(busy(b), b.vram);
+        });
+        std::copy_n(m_usage.begin(), count, out.rows.begin());
+        out.count = static_cast<std::uint32_t>(count);
+    }
+
+private:
+    static constexpr std::int64_t walk_interval = 5000000000ll;
+    static constexpr std::int64_t rescan_interval = 30000000000ll;
+
+    struct process {
+        char name[16] = {};
+        std::vector<int> fds; // that refer to GPU files
+        std::int64_t scanned = 0;
+        bool seen = false;
+    };
+
+    // The engine times of one DRM client, i.e. one open GPU file that may be
+    // shared by several fds. Client ids are unique across devices.
+    struct client {
+        std::uint64_t engines[engine_count];
+        std::int64_t time;
+        std::uint64_t generation;
+    };
+
+    // The values of one fdinfo file.
+    struct fdinfo {
+        int card = -1;
+        std::uint64_t client_id = 0;
+        bool has_client_id = false;
+        std::uint64_t engines[engine_count] = {};
+        std::uint64_t vram = 0;
+        std::uint64_t gtt = 0;
+    };
+
+    static std::uint32_t busy(const process_usage &usage)
+    {
+        return std::accumulate(std::begin(usage.engines), std::end(usage.engines), 0u);
+    }
+
+    void walk(std::int64_t now)
+    {
+        for (auto &[pid, proc] : m_processes) {
+            proc.seen = false;
+        }
+
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator("/proc/", ec)) {
+            auto name = entry.path().filename().string();
+            std::int32_t pid;
+            auto [ptr, err] = std::from_chars(name.data(), name.data() + name.size(), pid);
+            if (err != std::errc() || ptr != name.data() + name.size()) {
+                continue;
+            }
+
+            auto [itr, inserted] = m_processes.try_emplace(pid);
+            auto &proc = itr->second;
+            proc.seen = true;
+            if (inserted) {
+                read_name(entry.path(), proc);
+            }
+            if (inserted || now - proc.scanned >= rescan_interval) {
+                scan_fds(entry.path(), proc);
+                proc.scanned = now;
+            }
+        }
+
+        for (auto itr = m_processes.begin(); itr != m_processes.end();) {
+            itr = itr->second.seen ? std::next(itr) : m_processes.erase(itr);
+        }
+    }
+
+    // Reads the start of a file under /proc in one go.
+    static ssize_t read_proc_file(const char *path, char *buf, size_t size)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        auto n = ::read(fd, buf, size);
+        ::close(fd);
+        return n;
+    }
+
+    static void read_name(const std::filesystem::path &dir, process &proc)
+    {
+        char buf[64];
+        auto n = read_proc_file((dir / "comm").c_str(), buf, sizeof(buf));
+        if (n > 0) {
+            std::string_view comm(buf, static_cast<size_t>(n));
+            comm = comm.substr(0, std::min({comm.find('\n'), comm.size(), sizeof(proc.name) - 1}));
+            comm.copy(proc.name, comm.size());
+        }
+    }
+
+    // Remembers the fds that refer to a DRM device.
+    static void scan_fds(const std::filesystem::path &dir, process &proc)
+    {
+        proc.fds.clear();
+
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(dir / "fd", ec)) {
+            char target[64];
+            auto n = readlink(entry.path().c_str(), target, sizeof(target));
+            if (n <= 0 || std::string_view(target, static_cast<size_t>(n)).compare(0, 9, "/dev/dri/") != 0) {
+                continue;
+            }
+            auto name = entry.path().filename().string();
+            int fd;
+            auto [ptr, err] = std::from_chars(name.data(), name.data() + name.size(), fd);
+            if (err == std::errc() && ptr == name.data() + name.size()) {
+                proc.fds.push_back(fd);
+            }
+        }
+    }
+
+    void read_process(std::int32_t pid, process &proc, std::int64_t now)
+    {
+        for (auto itr = proc.fds.begin(); itr != proc.fds.end();) {
+            fdinfo info;
+            if (!parse(pid, *itr, info)) {
+                // The fd was closed, or reused for something else.
+                itr = proc.fds.erase(itr);
+                continue;
+            }
+            ++itr;
+
+            if (info.card < 0 || !info.has_client_id) {
+                continue;
+            }
+
+            auto [client_itr, inserted] = m_clients.try_emplace(info.client_id);
+            auto &c = client_itr->second;
+            if (!inserted && c.generation == m_generation) {
+                continue; // another fd of the same client
+            }
+
+            auto &usage = usage_of(pid, proc, static_cast<std::uint32_t>(info.card));
+            usage.vram += info.vram;
+            usage.gtt += info.gtt;
+            if (!inserted && now > c.time) {
+                auto elapsed = static_cast<std::uint64_t>(now - c.time);
+                for (size_t e = 0; e < engine_count; ++e) {
+                    auto delta = info.engines[e] > c.engines[e] ? info.engines[e] - c.engines[e] : 0;
+                    usage.engines[e] += static_cast<std::uint32_t>(delta * 1000 / elapsed);
+                }
+            }
+
+            std::copy(std::begin(info.engines), std::end(info.engines), std::begin(c.engines));
+            c.time = now;
+            c.generation = m_generation;
+        }
+    }
+
+    process_usage &usage_of(std::int32_t pid, const process &proc, std::uint32_t card)
+    {
+        for (auto itr = m_usage.rbegin(); itr != m_usage.rend() && itr->pid == pid; ++itr) {
+            if (itr->card == card) {
+                return *itr;
+            }
+        }
+
+        auto &usage = m_usage.emplace_back();
+        usage.pid = pid;
+        usage.card = card;
+        std::copy(std::begin(proc.name), std::end(proc.name), std::begin(usage.name));
+        return usage;
+    }
+
+    // Parses the drm-* keys of the fdinfo file of fd of pid. Returns false if
+    // the file could not be read or does not describe an amdgpu client.
+    bool parse(std::int32_t pid, int fd, fdinfo &info) const
+    {
+        char path[64];
+        std::snprintf(path, sizeof(path), "/proc/%d/fdinfo/%d", static_cast<int>(pid), fd);
+        char buf[4096];
+        auto n = read_proc_file(path, buf, sizeof(buf));
+        if (n <= 0) {
+            return false;
+        }
+
+        bool amdgpu = false;
+        std::string_view text(buf, static_cast<size_t>(n));
+        while (!text.empty()) {
+            auto eol = std::min(text.find('\n'), text.size());
+            auto line = text.substr(0, eol);
+            text.remove_prefix(std::min(eol + 1, text.size()));
+
+            auto colon = line.find(':');
+            if (colon == std::string_view::npos || line.compare(0, 4, "drm-") != 0) {
+                continue;
+            }
+            auto key = line.substr(4, colon - 4);
+            auto value = line.substr(colon + 1);
+            value.remove_prefix(std::min(value.find_first_not_of(" \t"), value.size()));
+
+            if (key == "driver") {
+                amdgpu = value == "amdgpu";
+            } else if (key == "pdev") {
+                auto itr = std::find(m_slots.begin(), m_slots.end(), value);
+                info.card = itr == m_slots.end() ? -1 : static_cast<int>(itr - m_slots.begin());
+            } else if (key == "client-id") {
+                info.has_client_id = parse_number(value, info.client_id);
+            } else if (key.compare(0, 7, "engine-") == 0) {
+                auto name = key.substr(7);
+                auto itr = std::find(std::begin(engine_names), std::end(engine_names), name);
+                std::uint64_t ns;
+                if (parse_number(value, ns)) {
+                    info.engines[itr - std::begin(engine_names)] += ns;
+                }
+            } else if (key == "memory-vram") {
+                parse_number(value, info.vram);
+            } else if (key == "memory-gtt") {
+                parse_number(value, info.gtt);
+            }
+        }
+        return amdgpu;
+    }
+
+    // Parses a number with an optional unit of ns, KiB or MiB, the latter two
+    // converted to bytes.
+    static bool parse_number(std::string_view text, std::uint64_t &value)
+    {
+        auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec != std::errc()) {
+            return false;
+        }
+
+        std::string_view unit(ptr, static_cast<size_t>(text.data() + text.size() - ptr));
+        unit.remove_prefix(std::min(unit.find_first_not_of(' '), unit.size()));
+        if (unit == "KiB") {
+            value *= 1024;
+        } else if (unit == "MiB") {
+            value *= 1024 * 1024;
+        }
+        return true;
+    }
+
+    std::vector<std::string> m_slots;
+    std::unordered_map<std::int32_t, process> m_processes;
+    std::unordered_map<std::uint64_t, client> m_clients;
+    std::vector<process_usage> m_usage;
+    std::int64_t m_last_walk = std::numeric_limits<std::int64_t>::min() / 2;
+    std::uint64_t m_generation = 0;
+};
+
+// The rows whose time per DPM level is tracked.
+const unsigned dpm_rows[] = {info::sclk_level, info::mclk_level};
+const size_t dpm_count = std::size(dpm_rows);
+const size_t max_dpm_levels = 16;
+
+int dpm_index(unsigned row)
+{
+    auto itr = std::find(std::begin(dpm_rows), std::end(dpm_rows), row);
+    return itr == std::end(dpm_rows) ? -1 : static_cast<int>(itr - std::begin(dpm_rows));
+}
+
+// What is computed from consecutive samples of a card rather than read.
+struct derived_values {
+    // The energy used since the first sample, in microjoules.
+    std::uint64_t energy;
+    bool has_energy;
+    // The time spent at each level of the DPM rows since the first sample.
+    std::int64_t level_ns[dpm_count][max_dpm_levels];
+    unsigned levels[dpm_count]; // the number of levels seen
+};
+
+// Returns s with the rows that are derived rather than read taken from d, as
+// they are shown and exported.
+sample with_derived(sample s, const derived_values &d)
+{
+    s.valid &= ~(1u << info::energy);
+    if (d.has_energy) {
+        s.values[info::energy] = d.energy;
+        s.valid |= 1u << info::energy;
+    }
+    return s;
+}
+
+// Keeps the previous sample of every card and when it was taken, and turns
+// consecutive samples into derived values: the energy counter into the energy
+// used since the first sample, or the power draw where a card has no counter,
+// and the DPM levels into the time spent at each one. Nothing is read for it.
+class rate_stage {
+public:
+    explicit rate_stage(size_t cards = 0)
+        : m_cards(cards)
+    {
+    }
+
+    // Forgets every previous sample, e.g. after a jump in a recording.
+    void reset()
+    {
+        std::fill(m_cards.begin(), m_cards.end(), state{});
+    }
+
+    // Takes s, sampled at now on a monotonic clock, into account and returns
+    // the derived values of its card. Cards may be updated concurrently.
+    void update(size_t card, const sample &s, std::int64_t now, derived_values &out)
+    {
+        auto &st = m_cards[card];
+        auto &d = st.totals;
+        auto elapsed = now - st.time;
+
+        if (st.started && elapsed > 0) {
+            if (s.has(info::energy) && st.previous.has(info::energy)) {
+                // A counter that went backwards was reset.
+                auto before = st.previous.values[info::energy];
+                auto after = s.values[info::energy];
+                d.energy += after >= before ? after - before : 0;
+            } else if (!s.has(info::energy) && st.previous.has(info::power)) {
+                d.energy += static_cast<std::uint64_t>(static_cast<double>(st.previous.values[info::power]) *
+                                                       static_cast<double>(elapsed) / 1e9);
+            }
+
+            // The level seen by the previous sample is taken to have held
+            // until this one.
+            for (size_t i = 0; i < dpm_count; ++i) {
+                if (!st.previous.has(dpm_rows[i])) {
+                    continue;
+                }
+                auto level = st.previous.values[dpm_rows[i]];
+                if (level < max_dpm_levels) {
+                    d.level_ns[i][level] += elapsed;
+                    d.levels[i] = std::max(d.levels[i], static_cast<unsigned>(level + 1));
+                }
+            }
+        }
+
+        d.has_energy = d.has_energy || s.has(info::energy) || s.has(info::power);
+        st.started = true;
+        st.time = now;
+        st.previous = s;
+        out = d;
+    }
+
+private:
+    struct state {
+        bool started = false;
+        std::int64_t time = 0;
+        sample previous = {};
+        derived_values totals = {};
+    };
+
+    std::vector<state> m_cards;
+};
+
+// A threshold on a row of every card, given to --alert as
+// ROW>VALUE[%][,for=SECONDS][,clear=VALUE[%]][,when=ROW>VALUE[%]], or with <
+// for a floor. Values are in the units the row is shown in, or a percentage
+// of the row's bar with %.
+struct alert_condition {
+    unsigned row = info::row_count;
+    bool above = true;
+    bool percent = false;
+    double threshold = 0.0;
+};
+
+struct alert_rule {
+    std::string text;
+    alert_condition condition;
+    double clear = 0.0;         // where a fired rule clears, past the threshold
+    std::int64_t hold_ns = 0;   // how long the condition must hold to fire
+    alert_condition when;       // must also hold, unless its row is row_count
+};
+
+// Parses ROW>VALUE[%] from the start of text and removes it from text.
+bool parse_alert_condition(std::string_view &text, alert_condition &c)
+{
+    auto op = text.find_first_of("<>");
+    if (op == std::string_view::npos) {
+        return false;
+    }
+    c.row = info::find(text.substr(0, op));
+    c.above = text[op] == '>';
+    text.remove_prefix(op + 1);
+
+    std::string number(text.substr(0, text.find_first_of("%,")));
+    char *end;
+    c.threshold = std::strtod(number.c_str(), &end);
+    if (c.row == info::row_count || number.empty() || *end != '\0') {
+        return false;
+    }
+    text.remove_prefix(number.size());
+    c.percent = !text.empty() && text.front() == '%';
+    if (c.percent) {
+        text.remove_prefix(1);
+    }
+    return !c.percent || info::metrics[c.row].kind == info::display::bar;
+}
+
+// Parses a rule given to --alert. Unless given, a rule clears 5 points or 5%
+// short of its threshold.
+bool parse_alert(std::string_view text, alert_rule &rule)
+{
+    rule.text = text;
+    if (!parse_alert_condition(text, rule.condition)) {
+        return false;
+    }
+
+    const auto &c = rule.condition;
+    auto margin = c.percent ? 5.0 : std::abs(c.threshold) * 0.05;
+    rule.clear = c.above ? c.threshold - margin : c.threshold + margin;
+
+    while (!text.empty()) {
+        if (text.front() != ',') {
+            return false;
+        }
+        text.remove_prefix(1);
+        auto value = text.substr(text.find('=') + 1);
+        if (text.compare(0, 4, "for=") == 0) {
+            std::string number(value.substr(0, value.find(',')));
+            char *end;
+            auto seconds = std::strtod(number.c_str(), &end);
+            if (number.empty() || *end != '\0' || !(seconds >= 0.0)) {
+                return false;
+            }
+            rule.hold_ns = static_cast<std::int64_t>(seconds * 1e9);
+            text = value.substr(number.size());
+        } else if (text.compare(0, 6, "clear=") == 0) {
+            alert_condition clear;
+            std::string condition = std::string(info::metrics[c.row].name) + (c.above ? ">" : "<");
+            condition += value.substr(0, value.find(','));
+            std::string_view rest = condition;
+            if (!parse_alert_condition(rest, clear) || clear.percent != c.percent) {
+                return false;
+            }
+            rule.clear = clear.threshold;
+            text = value.substr(value.find(',') == std::string_view::npos ? value.size() : value.find(','));
+        } else if (text.compare(0, 5, "when=") == 0) {
+            text = value;
+            if (!parse_alert_condition(text, rule.when)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A rule that is firing on a card.
+struct firing_alert {
+    const alert_rule *rule;
+    std::uint32_t card;
+};
+
+// Everything the sampler publishes at once.
+struct frame {
+    std::vector<sample> samples;
+    std::vector<aggregate> aggregates;
+    std::vector<derived_values> derived;
+    // The limits of every card as of the samples.
+    std::vector<struct limits> limits;
+    process_table processes;
+    // What taking the samples cost.
+    std::int64_t sample_ns = 0;
+    std::uint64_t sample_syscalls = 0;
+    std::vector<firing_alert> alerts;
+};
+
+// Evaluates the rules of --alert against every update on the sampler thread,
+// in O(rules * cards) and without allocating until there is something to
+// report. A rule fires on a card once its
+// condition held for its hold time, and clears only once the value is back
+// past its clear value, so a value hovering around the threshold does not
+// flap. Every change is written as an event line to the events file
+// descriptor unless it is negative and runs the hook command, if any, with the
+// event in its environment.
+class alert_engine {
+public:
+    alert_engine(const std::vector<alert_rule> &rules, const std::vector<device> &devices,
+                 int events_fd, std::string_view hook)
+        : m_rules(rules)
+        , m_devices(devices)
+        , m_events_fd(events_fd)
+        , m_hook(hook)
+        , m_state(rules.size() * devices.size())
+    {
+    }
+
+    // Evaluates the samples of f at now_ns and lists the rules that are
+    // firing in f.alerts.
+    void update(frame &f, std::int64_t now_ns)
+    {
+        f.alerts.clear();
+        if (m_rules.empty()) {
+            return;
+        }
+        // Only the hooks are reaped, so other children of gpumon are left to
+        // whoever started them.
+        m_children.erase(std::remove_if(m_children.begin(), m_children.end(),
+                                        [](pid_t pid){ return waitpid(pid, nullptr, WNOHANG) != 0; }),
+                         m_children.end());
+
+        for (size_t i = 0; i < m_devices.size(); ++i) {
+            auto s = with_derived(f.samples[i], f.derived[i]);
+            const auto &lim = f.limits[i];
+            for (size_t r = 0; r < m_rules.size(); ++r) {
+                const auto &rule = m_rules[r];
+                auto &st = m_state[r * m_devices.size() + i];
+                auto v = value(rule.condition, s, lim);
+                bool when = rule.when.row == info::row_count || holds(rule.when, value(rule.when, s, lim));
+
+                if (!st.firing) {
+                    if (!when || !holds(rule.condition, v)) {
+                        st.since_ns = -1;
+                    } else if (st.since_ns < 0) {
+                        st.since_ns = now_ns;
+                    }
+                    if (st.since_ns >= 0 && now_ns - st.since_ns >= rule.hold_ns) {
+                        st.firing = true;
+                        report(rule, i, true, v, s.time);
+                    }
+                } else if (!when || (rule.condition.above ? v < rule.clear : v > rule.clear)) {
+                    st.firing = false;
+                    st.since_ns = -1;
+                    report(rule, i, false, v, s.time);
+                }
+
+                if (st.firing) {
+                    f.alerts.push_back({&rule, static_cast<std::uint32_t>(i)});
+                }
+            }
+        }
+    }
+
+private:
+    struct state {
+        bool firing = false;
+        std::int64_t since_ns = -1; // when the condition began to hold
+    };
+
+    // The value of the row of s as compared by c, or NaN if it was not read.
+    static double value(const alert_condition &c, const sample &s, const limits &lim)
+    {
+        if (!s.has(c.row)) {
+            return NAN;
+        }
+        auto v = static_cast<double>(s.values[c.row]);
+        if (c.percent) {
+            auto [low, high] = bar_range(info::metrics[c.row].normalize, lim);
+            return (v - low) / (high - low) * 100.0;
+        }
+        return v / static_cast<double>(info::metrics[c.row].divisor);
+    }
+
+    static bool holds(const alert_condition &c, double v)
+    {
+        return c.above ? v > c.threshold : v < c.threshold;
+    }
+
+    void report(const alert_rule &rule, size_t card, bool firing, double v, std::uint64_t time_ms)
+    {
+        char value[32];
+        std::snprintf(value, sizeof(value), "%.1f", v);
+
+        if (m_events_fd >= 0) {
+            char line[256];
+            auto n = std::snprintf(line, sizeof(line), "alert %llu %s %s %s %s\n",
+                                   static_cast<unsigned long long>(time_ms), m_devices[card].name().c_str(),
+                                   firing ? "fired" : "cleared", rule.text.c_str(), value);
+            if (n > 0) {
+                write_all(m_events_fd, line, std::min(static_cast<size_t>(n), sizeof(line) - 1));
+            }
+        }
+
+        if (!m_hook.empty()) {
+            run_hook(rule, card, firing, value);
+        }
+    }
+
+    // Runs the hook with sh -c and GPUMON_ALERT set to fired or cleared, and
+    // GPUMON_CARD, GPUMON_RULE and GPUMON_VALUE to the rest of the event. It is
+    // not waited for, but reaped by a later update.
+    void run_hook(const alert_rule &rule, size_t card, bool firing, const char *value)
+    {
+        std::vector<std::string> vars = {
+            std::string("GPUMON_ALERT=") + (firing ? "fired" : "cleared"),
+            "GPUMON_CARD=" + m_devices[card].name(),
+            "GPUMON_RULE=" + rule.text,
+            std::string("GPUMON_VALUE=") + value,
+        };
+        std::vector<char *> env;
+        for (auto **e = environ; *e; ++e) {
+            env.push_back(*e);
+        }
+        for (auto &var : vars) {
+            env.push_back(var.data());
+        }
+        env.push_back(nullptr);
+
+        // The thread that started the sampler blocks the signals it handles,
+        // which the hook should not inherit.
+        posix_spawnattr_t attr;
+        sigset_t none;
+        sigemptyset(&none);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &none);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+        char sh[] = "sh", c[] = "-c";
+        char *argv[] = {sh, c, m_hook.data(), nullptr};
+        pid_t pid;
+        if (posix_spawn(&pid, "/bin/sh", nullptr, &attr, argv, env.data()) == 0) {
+            m_children.push_back(pid);
+        }
+        posix_spawnattr_destroy(&attr);
+    }
+
+    const std::vector<alert_rule> &m_rules;
+    const std::vector<device> &m_devices;
+    int m_events_fd;
+    std::string m_hook;
+    std::vector<state> m_state;
+    std::vector<pid_t> m_children; // the hooks not reaped yet
+};
+
+static_assert(info::row_count <= gpumon_shm::max_rows, "the shared memory layout needs more rows");
+
+// Publishes the newest sample of every card for --shm in a POSIX shared memory
+// segment laid out as in gpumon_shm.hpp, so that local readers get them
+// without reading sysfs or making system calls. A segment left behind by a run
+// that has exited is replaced rather than reused, as readers may still map it,
+// but one that another gpumon still publishes to is left alone.
+class shm_publisher {
+public:
+    shm_publisher() = default;
+
+    shm_publisher(const shm_publisher &) = delete;
+    shm_publisher &operator=(const shm_publisher &) = delete;
+
+    ~shm_publisher()
+    {
+        if (m_header) {
+            m_header->writer.store(0, std::memory_order_relaxed);
+            munmap(m_header, m_size);
+            // Another gpumon may have replaced the segment meanwhile.
+            if (is_ours()) {
+                shm_unlink(m_name.c_str());
+            }
+        }
+    }
+
+    bool open(std::string_view name, const std::vector<device> &devices, std::int64_t interval)
+    {
+        m_name = name;
+        if (m_name.empty() || m_name.front() != '/') {
+            m_name.insert(0, "/");
+        }
+        if (auto pid = live_writer()) {
+            std::cerr << m_name << ": already published by pid " << pid << '\n';
+            return false;
+        }
+        shm_unlink(m_name.c_str());
+        int fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(m_name.c_str());
+            if (fd >= 0) {
+                ::close(fd);
+                shm_unlink(m_name.c_str());
+            }
+            return false;
+        }
+        m_device = st.st_dev;
+        m_inode = st.st_ino;
+
+        auto size = gpumon_shm::segment_size(devices.size());
+        void *data = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+            data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            perror(m_name.c_str());
+            shm_unlink(m_name.c_str());
+            return false;
+        }
+        m_size = size;
+
+        m_header = new (data) gpumon_shm::header{};
+        m_header->version = gpumon_shm::version;
+        m_header->header_size = sizeof(gpumon_shm::header);
+        m_header->card_size = sizeof(gpumon_shm::card);
+        m_header->card_count = static_cast<std::uint32_t>(devices.size());
+        m_header->row_count = info::row_count;
+        m_header->interval_ns = interval;
+        for (unsigned row = 0; row < info::row_count; ++row) {
+            auto name = info::metrics[row].name;
+            name.copy(m_header->rows[row], std::min(name.size(), gpumon_shm::name_size - 1));
+        }
+        m_cards = gpumon_shm::cards_of(m_header);
+        for (size_t i = 0; i < devices.size(); ++i) {
+            new (&m_cards[i]) gpumon_shm::card{};
+            const auto &card = devices[i].name();
+            card.copy(m_cards[i].name, std::min(card.size(), gpumon_shm::name_size - 1));
+        }
+        m_header->writer.store(static_cast<std::int32_t>(getpid()), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_header->magic = gpumon_shm::magic;
+        return true;
+    }
+
+    void publish(const frame &f)
+    {
+        gpumon_shm::begin_write(*m_header);
+        for (size_t i = 0; i < f.samples.size(); ++i) {
+            auto s = with_derived(f.samples[i], f.derived[i]);
+            const auto &lim = f.limits[i];
+            auto &out = m_cards[i];
+            out.time = s.time;
+            out.valid = s.valid;
+            std::copy(std::begin(s.values), std::end(s.values), out.values);
+            out.vram_total = lim.vram;
+            out.gtt_total = lim.gtt;
+            out.vis_vram_total = lim.vis_vram;
+            out.power_cap_min = lim.power_min;
+            out.power_cap_max = lim.power_max;
+            out.temp_crit = lim.temp_crit;
+            out.fan_min = lim.fan_min;
+            out.fan_max = lim.fan_max;
+        }
+        gpumon_shm::end_write(*m_header);
+    }
+
+    void set_interval(std::int64_t interval)
+    {
+        gpumon_shm::begin_write(*m_header);
+        m_header->interval_ns = interval;
+        gpumon_shm::end_write(*m_header);
+    }
+
+private:
+    // The pid of the gpumon that publishes to the segment called m_name if
+    // it is still running, 0 otherwise.
+    pid_t live_writer() const
+    {
+        int fd = shm_open(m_name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return 0;
+        }
+        struct stat st;
+        void *data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(gpumon_shm::header)) {
+            data = mmap(nullptr, sizeof(gpumon_shm::header), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            return 0;
+        }
+        const auto *h = static_cast<const gpumon_shm::header *>(data);
+        pid_t pid = h->magic == gpumon_shm::magic && h->header_size == sizeof(gpumon_shm::header) ?
+            h->writer.load(std::memory_order_relaxed) : 0;
+        munmap(data, sizeof(gpumon_shm::header));
+        // EPERM means the process exists but belongs to someone else.
+        return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM) ? pid : 0;
+    }
+
+    // Whether m_name still names the segment this created.
+    bool is_ours() const
+    {
+        int fd = shm_open(m_name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ours = fstat(fd, &st) == 0 && st.st_dev == m_device && st.st_ino == m_inode;
+        ::close(fd);
+        return ours;
+    }
+
+    std::string m_name;
+    gpumon_shm::header *m_header = nullptr;
+    gpumon_shm::card *m_cards = nullptr;
+    size_t m_size = 0;
+    dev_t m_device = 0;
+    ino_t m_inode = 0;
+};
+
+struct sampler_config {
+    // A negative interval only samples when poked.
+    std::int64_t interval = 2000000000ll;
+    // If positive, the oversampled rows are also read at this period and the
+    // samples carry their mean over the update interval instead of a single
+    // reading.
+    std::int64_t oversample = -1;
+    // If positive, the interval is doubled up to this while busy, power and
+    // VRAM usage stay flat, and oversampling pauses.
+    std::int64_t adaptive_max = -1;
+    // Evaluated against every update, see alert_engine. Events are written
+    // to alert_fd unless it is negative.
+    std::vector<alert_rule> alerts;
+    std::string alert_hook;
+    int alert_fd = -1;
+    // Every update is also published here unless it is null.
+    shm_publisher *shm = nullptr;
+};
+
+// Samples every device on a thread of its own, at its own interval, and
+// publishes the newest frame through a triple buffer. A slow sysfs read
+// therefore never stalls drawing or keyboard handling. The sampler thread
+// inherits the signal mask of the thread that calls start().
+class sampler {
+public:
+    sampler(const std::vector<device> &devices, const row_set &enabled_rows,
+            const sampler_config &config)
+        : m_devices(devices)
+        , m_config(config)
+        , m_requested_rows(enabled_rows.mask())
+        , m_requested_interval(config.interval)
+        , m_pool(devices.size())
+        , m_frames(frame{std::vector<sample>(devices.size(), sample{}),
+                         std::vector<aggregate>(devices.size(), aggregate{}),
+                         std::vector<derived_values>(devices.size(), derived_values{}),
+                         initial_limits(devices), process_table{}, 0, 0, {}})
+        , m_scratch(devices.size())
+        , m_stats(devices.size())
+        , m_rates(devices.size())
+        , m_previous(devices.size(), sample{})
+        , m_limits(initial_limits(devices))
+        , m_limits_time(monotonic_ns())
+        , m_scanner(devices)
+        , m_alerts(m_config.alerts, devices, m_config.alert_fd, m_config.alert_hook)
+    {
+        for (const auto &rule : m_config.alerts) {
+            m_alert_rows.set(rule.condition.row, true);
+            if (rule.when.row < info::row_count) {
+                m_alert_rows.set(rule.when.row, true);
+            }
+        }
+        apply_rows();
+    }
+
+    sampler(const sampler &) = delete;
+    sampler &operator=(const sampler &) = delete;
+
+    ~sampler()
+    {
+        stop();
+    }
+
+    bool oversampling() const
+    {
+        return m_config.oversample > 0;
+    }
+
+    // Takes the first sample before returning, so that current() holds real
+    // values right away.
+    void start()
+    {
+        sample_all();
+        update();
+        m_thread = std::thread([this]{ run(); });
+    }
+
+    void stop()
+    {
+        if (m_thread.joinable()) {
+            m_stopping = true;
+            m_control.notify();
+            m_thread.join();
+        }
+    }
+
+    // Whether frames list the processes using the GPUs. Off by default, as
+    // finding them costs more than sampling the devices.
+    void scan_processes(bool enable)
+    {
+        m_scan_processes = enable;
+    }
+
+    // Asks the sampler thread to take a sample right away.
+    void poke()
+    {
+        m_control.notify();
+    }
+
+    // Changes the rows that are read from the next sample on, which is taken
+    // right away. Rows that alert rules watch are read either way.
+    void set_rows(const row_set &rows)
+    {
+        m_requested_rows = rows.mask();
+        poke();
+    }
+
+    // Changes the update interval and takes a sample right away.
+    void set_interval(std::int64_t interval)
+    {
+        m_requested_interval = interval;
+        poke();
+    }
+
+    // Readable whenever a new frame has been published. Drain it with
+    // drain() before calling update().
+    int fd() const
+    {
+        return m_published.fd();
+    }
+
+    void drain() const
+    {
+        m_published.drain();
+    }
+
+    // Makes the newest published frame available through current(). Returns
+    // false if there was none since the last call.
+    bool update()
+    {
+        return m_frames.update();
+    }
+
+    const frame &current() const
+    {
+        return m_frames.front();
+    }
+
+private:
+    void accumulate(size_t card, const sample &s)
+    {
+        for (size_t i = 0; i < oversampled_count; ++i) {
+            if (s.has(oversampled_rows[i])) {
+                m_stats[card][i].add(static_cast<double>(s.values[oversampled_rows[i]]));
+            }
+        }
+    }
+
+    void oversample()
+    {
+        m_pool.run([&](size_t i){
+            m_devices[i].sample(m_scratch[i], m_fast_rows);
+            accumulate(i, m_scratch[i]);
+        });
+    }
+
+    // Whether any card is busy, or its busy, power or VRAM usage moved by
+    // more than a little since the previous update. Remembers samples for
+    // the next call.
+    bool active(const std::vector<sample> &samples)
+    {
+        const std::uint64_t busy_threshold = 10;
+
+        static const struct {
+            unsigned row;
+            std::uint64_t threshold;
+        } watched[] = {
+            {info::busy, 5},
+            {info::power, 5000000},
+            {info::vram, 64ull << 20},
+        };
+
+        bool changed = false;
+        for (size_t i = 0; i < samples.size(); ++i) {
+            if (samples[i].has(info::busy) && samples[i].values[info::busy] >= busy_threshold) {
+                changed = true;
+            }
+            for (const auto &w : watched) {
+                if (samples[i].has(w.row) != m_previous[i].has(w.row)) {
+                    changed = true;
+                } else if (samples[i].has(w.row)) {
+                    auto a = samples[i].values[w.row];
+                    auto b = m_previous[i].values[w.row];
+                    changed = changed || (a > b ? a - b : b - a) >= w.threshold;
+                }
+            }
+            m_previous[i] = samples[i];
+        }
+        return changed;
+    }
+
+    static std::vector<struct limits> initial_limits(const std::vector<device> &devices)
+    {
+        std::vector<struct limits> out;
+        for (const auto &dev : devices) {
+            out.push_back(dev.limits());
+        }
+        return out;
+    }
+
+    // Takes on the rows asked for by set_rows().
+    void apply_rows()
+    {
+        auto mask = m_requested_rows.load() | m_alert_rows.mask();
+        if (mask == m_rows.mask()) {
+            return;
+        }
+        m_rows = row_set::from_mask(mask);
+        for (auto row : oversampled_rows) {
+            m_fast_rows.set(row, m_rows.test(row));
+        }
+    }
+
+    void sample_all()
+    {
+        apply_rows();
+
+        auto &out = m_frames.back();
+        auto start = monotonic_ns();
+        auto syscalls = counters::syscalls.load(std::memory_order_relaxed);
+
+        bool refresh_limits = start - m_limits_time >= info::slow_refresh;
+        if (refresh_limits) {
+            m_limits_time = start;
+        }
+
+        m_pool.run([&](size_t i){
+            auto &s = out.samples[i];
+            m_devices[i].sample(s, m_rows);
+            if (oversampling()) {
+                accumulate(i, s);
+                auto &agg = out.aggregates[i];
+                for (size_t r = 0; r < oversampled_count; ++r) {
+                    agg.counts[r] = m_stats[i][r].take(agg.rows[r]);
+                    if (agg.counts[r] > 0) {
+                        s.values[oversampled_rows[r]] = agg.rows[r].mean;
+                        s.valid |= 1u << oversampled_rows[r];
+                    }
+                }
+            }
+            m_rates.update(i, s, monotonic_ns(), out.derived[i]);
+
+            if (refresh_limits) {
+                m_devices[i].refresh_limits(m_limits[i]);
+            }
+            out.limits[i] = m_limits[i];
+        });
+
+        if (m_scan_processes) {
+            m_scanner.update(out.processes);
+        } else {
+            out.processes.count = 0;
+        }
+
+        m_alerts.update(out, start);
+        if (m_config.shm) {
+            m_config.shm->publish(out);
+        }
+
+        out.sample_ns = monotonic_ns() - start;
+        out.sample_syscalls = counters::syscalls.load(std::memory_order_relaxed) - syscalls;
+        m_active = active(out.samples);
+        m_frames.publish();
+        m_published.notify();
+    }
+
+    void run()
+    {
+        event_loop loop;
+        timer_fd timer;
+        timer_fd fast_timer;
+
+        if (m_config.interval >= 0) {
+            timer.set_period(std::max(m_config.interval, min_interval));
+        }
+        if (oversampling()) {
+            fast_timer.set_period(std::max(m_config.oversample, min_interval));
+        }
+
+        // In adaptive mode, every idle update doubles the interval and any
+        // activity or poke snaps it back.
+        auto interval = m_config.interval;
+        auto adapt = [&](bool active){
+            if (m_config.adaptive_max <= 0 || m_config.interval < 0) {
+                return;
+            }
+            auto next = active ? m_config.interval :
+                std::max(m_config.interval, std::min(interval * 2, m_config.adaptive_max));
+            if (next == interval) {
+                return;
+            }
+            interval = next;
+            timer.set_period(std::max(interval, min_interval));
+            if (oversampling()) {
+                fast_timer.set_period(active ? std::max(m_config.oversample, min_interval) : 0);
+            }
+        };
+
+        loop.add(timer.fd(), EPOLLIN, [&](std::uint32_t){
+            if (timer.read() > 0) {
+                sample_all();
+                adapt(m_active);
+            }
+        });
+
+        loop.add(fast_timer.fd(), EPOLLIN, [&](std::uint32_t){
+            if (fast_timer.read() > 0) {
+                oversample();
+            }
+        });
+
+        loop.add(m_control.fd(), EPOLLIN, [&](std::uint32_t){
+            m_control.drain();
+            if (m_stopping) {
+                loop.stop();
+                return;
+            }
+
+            auto requested = m_requested_interval.load();
+            if (requested != m_config.interval) {
+                m_config.interval = interval = requested;
+                if (m_config.shm) {
+                    m_config.shm->set_interval(requested);
+                }
+                timer.set_period(requested >= 0 ? std::max(requested, min_interval) : 0);
+            }
+            sample_all();
+            adapt(true);
+        });
+
+        loop.run();
+    }
+
+    const std::vector<device> &m_devices;
+    sampler_config m_config;
+    std::atomic<std::uint32_t> m_requested_rows;
+    std::atomic<std::int64_t> m_requested_interval;
+    row_set m_rows;
+    row_set m_alert_rows;
+    worker_pool m_pool;
+    triple_buffer<frame> m_frames;
+    event_fd m_published;
+    event_fd m_control;
+    std::atomic<bool> m_stopping = false;
+    std::thread m_thread;
+
+    row_set m_fast_rows;
+    std::vector<sample> m_scratch;
+    std::vector<std::array<running_stats, oversampled_count>> m_stats;
+    rate_stage m_rates;
+    std::vector<sample> m_previous;
+    std::vector<struct limits> m_limits;
+    std::int64_t m_limits_time;
+    bool m_active = true;
+
+    std::atomic<bool> m_scan_processes = false;
+    process_scanner m_scanner;
+    alert_engine m_alerts;
+};
+
+void draw_bar(int row, int col, int width, const bar_shape &bar, std::string_view str)
+{
+    move(row, col);
+    clrtoeol();
+
+    if (bar.length < 0) {
+        return;
+    }
+
+    width -= 2 + static_cast<int>(str.size());
+
+    attron(A_BOLD);
+    addch('[');
+    attroff(A_BOLD);
+
+    set_color(bar.color);
+    for (int i = 0; i < bar.length; ++i) {
+        addch('|');
+    }
+    remove_color(bar.color);
+
+    move(row, col + width + 1);
+
+    attron(A_BOLD);
+    print_string(color::type::value, str);
+    addch(']');
+    attroff(A_BOLD);
+}
+
+const int vpad = 1;
+const int hpad = 2;
+const int text_len = 13 + hpad;
+
+void set_row_option(row_set &enabled_rows, std::string_view option, bool enable)
+{
+    auto row = info::find(option);
+    if (row < info::row_count) {
+        enabled_rows.set(row, enable);
+    }
+}
+
+// Enables or disables each row in the comma separated list options.
+void set_row_options(row_set &enabled_rows, std::string_view options, bool enable)
+{
+    size_t idx = 0;
+    size_t prev_idx = 0;
+    while ((idx = options.find(',', prev_idx)) != std::string_view::npos) {
+        auto opt = options.substr(prev_idx, idx - prev_idx);
+        set_row_option(enabled_rows, opt, enable);
+        prev_idx = idx+1;
+    }
+
+    auto opt = options.substr(prev_idx);
+    set_row_option(enabled_rows, opt, enable);
+}
+
+// A fixed-size buffer for formatting the text of a row without allocating.
+// Text that does not fit is truncated.
+class row_text {
+public:
+    row_text &operator<<(std::string_view str)
+    {
+        auto n = std::min(str.size(), m_buf.size() - m_size);
+        std::copy_n(str.data(), n, m_buf.data() + m_size);
+        m_size += n;
+        return *this;
+    }
+
+    row_text &operator<<(std::uint64_t value)
+    {
+        auto [end, ec] = std::to_chars(m_buf.data() + m_size, m_buf.data() + m_buf.size(), value);
+        if (ec == std::errc()) {
+            m_size = static_cast<size_t>(end - m_buf.data());
+        }
+        return *this;
+    }
+
+    std::string_view view() const
+    {
+        return {m_buf.data(), m_size};
+    }
+
+    bool operator==(const row_text &other) const
+    {
+        return view() == other.view();
+    }
+
+private:
+    std::array<char, 128> m_buf;
+    size_t m_size = 0;
+};
+
+// How full the bar of the row of s is, from 0 to 1. Rows without a bar and
+// rows that were not read are empty.
+double fraction(unsigned row, const sample &s, const limits &lim)
+{
+    const auto &metric = info::metrics[row];
+    if (!s.has(row) || metric.kind != info::display::bar) {
+        return 0.0;
+    }
+
+    auto [low, high] = bar_range(metric.normalize, lim);
+    return (static_cast<double>(s.values[row]) - low) / (high - low);
+}
+
+// Formats value as the row shows it, without the suffix.
+void format_value(unsigned row, std::uint64_t value, row_text &text)
+{
+    const auto &metric = info::metrics[row];
+    text << metric.prefix << value / metric.divisor;
+    if (metric.decimal) {
+        text << "." << value % metric.divisor / (metric.divisor / 10);
+    }
+}
+
+// Formats the row of s for display, e.g. "45W", or "1024/8192MiB" for rows
+// that are a share of a total. Rows that were not read are shown as "N/A".
+void format_row(unsigned row, const sample &s, const limits &lim, row_text &text)
+{
+    if (!s.has(row)) {
+        text << "N/A";
+        return;
+    }
+
+    const auto &metric = info::metrics[row];
+    auto value = s.values[row];
+    if (metric.kind == info::display::residency) {
+        text << "level " << value;
+        return;
+    }
+
+    format_value(row, value, text);
+    switch (metric.normalize) {
+    case info::bound::vram:
+    case info::bound::gtt:
+    case info::bound::vis_vram:
+        text << "/" << static_cast<std::uint64_t>(bar_range(metric.normalize, lim).second) / metric.divisor;
+        break;
+    default:
+        break;
+    }
+    text << metric.suffix;
+}
+
+// Formats the row of s for a table cell, like format_row but without the total
+// of shares, e.g. "1024MiB".
+void format_cell(unsigned row, const sample &s, row_text &text)
+{
+    if (!s.has(row)) {
+        text << "N/A";
+        return;
+    }
+
+    const auto &metric = info::metrics[row];
+    if (metric.kind == info::display::residency) {
+        text << "level " << s.values[row];
+        return;
+    }
+    format_value(row, s.values[row], text);
+    text << metric.suffix;
+}
+
+// Formats the share of time spent at each level of a DPM row so far, with the
+// current level marked, e.g. "0:12% 1:80%* 2:8%". Until that is known, the
+// current level is shown instead.
+void format_residency(unsigned row, const sample &s, const derived_values &d, const limits &lim, row_text &text)
+{
+    auto index = static_cast<size_t>(dpm_index(row));
+    auto levels = d.levels[index];
+    auto total = std::accumulate(d.level_ns[index], d.level_ns[index] + levels, std::int64_t{0});
+    if (total <= 0) {
+        format_row(row, s, lim, text);
+        return;
+    }
+
+    for (unsigned level = 0; level < levels; ++level) {
+        auto percent = static_cast<std::uint64_t>(d.level_ns[index][level] * 100 / total);
+        text << (level > 0 ? " " : "") << level << ":" << percent << "%";
+        if (s.has(row) && s.values[row] == level) {
+            text << "*";
+        }
+    }
+}
+
+// Appends the range and p95 of an oversampled row over the last update
+// interval, e.g. " (2-99, p95 97)", in the units the row is displayed in.
+void format_summary(unsigned row, const aggregate &agg, row_text &text)
+{
+    auto index = oversampled_index(row);
+    if (index < 0 || agg.counts[index] == 0) {
+        return;
+    }
+
+    const auto &sum = agg.rows[index];
+    auto scale = info::metrics[row].divisor;
+    text << " (" << sum.min / scale << "-" << sum.max / scale << ", p95 " << sum.p95 / scale << ")";
+}
+
+// The rows that are kept in the history and drawn as graphs.
+const unsigned graphed_rows[] = {info::busy, info::power, info::temperature};
+const size_t graphed_count = std::size(graphed_rows);
+
+int graph_index(unsigned row)
+{
+    auto itr = std::find(std::begin(graphed_rows), std::end(graphed_rows), row);
+    return itr == std::end(graphed_rows) ? -1 : static_cast<int>(itr - std::begin(graphed_rows));
+}
+
+// The last few samples of the graphed rows of every card, normalized to their
+// bars. All series share one ring position and live in a single array that is
+// allocated up front, one contiguous ring per card and row, so pushing never
+// allocates. Rows that were not read are stored as NaN.
+class history {
+public:
+    history(size_t cards, size_t capacity)
+        : m_capacity(capacity)
+        , m_values(cards * graphed_count * capacity)
+    {
+    }
+
+    void push(const frame &f)
+    {
+        const auto &samples = f.samples;
+        m_head = (m_head + 1) % m_capacity;
+        m_size = std::min(m_size + 1, m_capacity);
+
+        for (size_t card = 0; card < samples.size(); ++card) {
+            for (size_t i = 0; i < graphed_count; ++i) {
+                auto row = graphed_rows[i];
+                m_values[series(card, i) + m_head] = samples[card].has(row) ?
+                    static_cast<float>(fraction(row, samples[card], f.limits[card])) : NAN;
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    void clear()
+    {
+        m_size = 0;
+    }
+
+    // The value of the series pushed age samples ago, where 0 is the newest.
+    // age must be less than size().
+    float at(size_t card, size_t index, size_t age) const
+    {
+        return m_values[series(card, index) + (m_head + m_capacity - age) % m_capacity];
+    }
+
+private:
+    size_t series(size_t card, size_t index) const
+    {
+        return (card * graphed_count + index) * m_capacity;
+    }
+
+    size_t m_capacity;
+    size_t m_head = 0;
+    size_t m_size = 0;
+    std::vector<float> m_values;
+};
+
+// The history covers the widest graph the current window can show, or the
+// last minute of samples if that is more, up to a fixed cap.
+size_t history_capacity(std::int64_t interval)
+{
+    size_t per_minute = interval > 0 ? static_cast<size_t>(60000000000ll / interval) : 0;
+    return std::clamp(std::max(static_cast<size_t>(COLS), per_minute), size_t{1}, size_t{4096});
+}
+
+bool use_unicode = false;
+
+// Draws the series of the row as a sparkline that ends with the newest
+// sample at the right edge of the graph.
+void draw_sparkline(int row, int col, int width, const history &hist, size_t card, size_t index)
+{
+    static const char *const unicode_levels[] = {"\u2581", "\u2582", "\u2583", "\u2584",
+                                                 "\u2585", "\u2586", "\u2587", "\u2588"};
+    static const char *const ascii_levels[] = {"_", ".", "-", "~", "=", "+", "*", "#"};
+    const auto &levels = use_unicode ? unicode_levels : ascii_levels;
+
+    move(row, col);
+    set_color(color::type::value);
+    attron(A_BOLD);
+    for (int x = 0; x < width; ++x) {
+        auto age = static_cast<size_t>(width - 1 - x);
+        auto value = age < hist.size() ? hist.at(card, index, age) : NAN;
+        if (std::isnan(value)) {
+            addch(' ');
+            continue;
+        }
+        auto level = static_cast<int>(std::clamp(value, 0.0f, 1.0f) * 7.0f + 0.5f);
+        addstr(levels[level]);
+    }
+    attroff(A_BOLD);
+    remove_color(color::type::value);
+}
+
+std::string_view row_name(unsigned row)
+{
+    return info::metrics[row].name;
+}
+
+// Disables every enabled row that no card supports, the same as passing it to
+// --disable, and reports the rows that are missing once.
+void probe_rows(const std::vector<device> &devices, row_set &enabled_rows)
+{
+    std::string disabled;
+    auto rows = enabled_rows;
+    for (unsigned row : rows) {
+        auto supported = std::count_if(devices.cbegin(), devices.cend(),
+            [row](const auto &dev){ return dev.supports(row); });
+
+        if (supported == 0) {
+            enabled_rows.reset(row);
+            disabled.append(disabled.empty() ? "" : ", ").append(row_name(row));
+            continue;
+        }
+
+        if (static_cast<size_t>(supported) < devices.size()) {
+            for (const auto &dev : devices) {
+                if (!dev.supports(row)) {
+                    std::cerr << dev.name() << ": " << row_name(row) << " is not supported\n";
+                }
+            }
+        }
+    }
+
+    if (!disabled.empty()) {
+        std::cerr << "Disabling unsupported rows: " << disabled << '\n';
+    }
+}
+
+// With more than one card every panel starts with a line naming its card.
+int panel_height(const row_set &enabled_rows, size_t card_count)
+{
+    auto rows = static_cast<int>(enabled_rows.size());
+    return card_count > 1 ? rows + 1 + vpad : rows;
+}
+
+void draw_labels(const std::vector<device> &devices, const row_set &enabled_rows)
+{
+    for (size_t i = 0; i < devices.size(); ++i) {
+        int row = vpad-1 + static_cast<int>(i) * panel_height(enabled_rows, devices.size());
+
+        set_color(color::type::label);
+        if (devices.size() > 1) {
+            attron(A_BOLD);
+            mvaddstr(++row, hpad, devices[i].name().c_str());
+            attroff(A_BOLD);
+        }
+
+        for (unsigned r : enabled_rows) {
+            mvaddstr(++row, hpad, info::metrics[r].label.data());
+        }
+        remove_color(color::type::label);
+    }
+}
+
+// The output last drawn on a value row. Rows that would be drawn the same way
+// again are skipped, so an idle GPU sends next to nothing to the terminal.
+// Resetting a drawn_row forces the row to be redrawn.
+struct drawn_row {
+    row_text text;
+    bar_shape bar = {-1, color::type::ok};
+    bool valid = false;
+};
+
+using drawn_rows = std::array<drawn_row, info::row_count>;
+
+// The width of the graphs drawn to the right of the bars of the graphed rows,
+// or 0 if graphs are hidden.
+int graph_width(bool show_graphs)
+{
+    return show_graphs ? (COLS - text_len - hpad) / 2 : 0;
+}
+
+// Graphed rows are narrowed by graph_width to leave room for their graphs.
+// If agg is not null, oversampled rows also show their summaries.
+void draw_values(int row, const row_set &enabled_rows, const limits &lim, const sample &raw,
+                 const derived_values &d, const aggregate *agg, drawn_rows &drawn, int graph_width)
+{
+    auto s = with_derived(raw, d);
+    for (unsigned r : enabled_rows) {
+        ++row;
+
+        int bar_width = COLS - text_len - hpad;
+        if (graph_width > 0 && graph_index(r) >= 0) {
+            bar_width -= graph_width + 1;
+        }
+
+        row_text text;
+        if (info::metrics[r].kind == info::display::residency) {
+            format_residency(r, s, d, lim, text);
+        } else {
+            format_row(r, s, lim, text);
+        }
+        if (agg) {
+            format_summary(r, *agg, text);
+        }
+        bool is_bar = info::metrics[r].kind == info::display::bar;
+        auto bar = is_bar ? shape_bar(bar_width, fraction(r, s, lim), text.view()) :
+            bar_shape{-1, color::type::ok};
+
+        if (drawn[r].valid && drawn[r].bar == bar && drawn[r].text == text) {
+            continue;
+        }
+        drawn[r] = {text, bar, true};
+
+        if (is_bar) {
+            draw_bar(row, text_len, bar_width, bar, text.view());
+        } else {
+            move(row, text_len);
+            clrtoeol();
+            print_string(color::type::label, text.view(), A_BOLD);
+        }
+    }
+}
+
+void draw_graphs(int row, const row_set &enabled_rows, const history &hist, size_t card,
+                 int graph_width)
+{
+    for (unsigned r : enabled_rows) {
+        ++row;
+
+        auto index = graph_index(r);
+        if (index >= 0) {
+            draw_sparkline(row, COLS - hpad - graph_width, graph_width, hist, card,
+                           static_cast<size_t>(index));
+        }
+    }
+}
+
+// The first line below the card panels.
+int panels_end(const row_set &enabled_rows, size_t card_count)
+{
+    auto height = static_cast<int>(card_count) * panel_height(enabled_rows, card_count);
+    return card_count > 1 ? height : vpad + height;
+}
+
+// Lists the processes on the lines from row up to end. Lines that do not
+// change are not sent to the terminal again by curses.
+void draw_processes(int row, int end, const process_table &table, const std::vector<device> &devices)
+{
+    if (row >= end) {
+        return;
+    }
+
+    char header[160];
+    std::snprintf(header, sizeof(header), "%-7s %-16s %-8s %7s %8s %7s %7s %9s %9s",
+                  "PID", "NAME", "CARD", "GFX", "COMPUTE", "DMA", "MEDIA", "VRAM", "GTT");
+    move(row, hpad);
+    clrtoeol();
+    print_string(color::type::label, std::string_view(header).substr(0, std::max(COLS - hpad, 0)), A_BOLD);
+
+    auto percent = [](std::uint32_t permille){ return permille / 10.0; };
+    for (std::uint32_t i = 0; i < table.count && ++row < end; ++i) {
+        const auto &p = table.rows[i];
+        char line[160];
+        std::snprintf(line, sizeof(line),
+                      "%-7d %-16.16s %-8s %6.1f%% %7.1f%% %6.1f%% %6.1f%% %6lluMiB %6lluMiB",
+                      p.pid, p.name, devices[p.card].name().c_str(),
+                      percent(p.engines[0]), percent(p.engines[1]), percent(p.engines[2]),
+                      percent(p.engines[3]), static_cast<unsigned long long>(p.vram >> 20),
+                      static_cast<unsigned long long>(p.gtt >> 20));
+        move(row, hpad);
+        clrtoeol();
+        addnstr(line, std::max(COLS - hpad, 0));
+    }
+
+    if (table.count == 0 && ++row < end) {
+        move(row, hpad);
+        clrtoeol();
+        addstr("no processes using the GPU found");
+    }
+
+    while (++row < end) {
+        move(row, 0);
+        clrtoeol();
+    }
+}
+
+// Orders names like "node2" before "node10" by comparing runs of digits as
+// numbers.
+bool natural_less(std::string_view l, std::string_view r)
+{
+    auto digit = [](char c){ return c >= '0' && c <= '9'; };
+    size_t i = 0, j = 0;
+    while (i < l.size() && j < r.size()) {
+        if (!digit(l[i]) || !digit(r[j])) {
+            if (l[i] != r[j]) {
+                return l[i] < r[j];
+            }
+            ++i;
+            ++j;
+            continue;
+        }
+
+        auto li = std::min(l.find_first_not_of("0123456789", i), l.size());
+        auto rj = std::min(r.find_first_not_of("0123456789", j), r.size());
+        auto a = l.substr(i, li - i), b = r.substr(j, rj - j);
+        a.remove_prefix(std::min(a.find_first_not_of('0'), a.size()));
+        b.remove_prefix(std::min(b.find_first_not_of('0'), b.size()));
+        if (a.size() != b.size()) {
+            return a.size() < b.size();
+        }
+        if (a != b) {
+            return a < b;
+        }
+        i = li;
+        j = rj;
+    }
+    return l.size() - i < r.size() - j;
+}
+
+// A screen line built up in a buffer and written with a single addnstr. Text
+// past width cells is cut off.
+class table_line {
+public:
+    explicit table_line(int width)
+        : m_width(width)
+    {
+    }
+
+    // Appends text that takes cells columns on the screen, or as much of it as
+    // fits if it is ASCII.
+    void append(std::string_view text, int cells)
+    {
+        if (m_cells + cells > m_width) {
+            if (cells != static_cast<int>(text.size())) {
+                m_cells = m_width;
+                return;
+            }
+            text = text.substr(0, static_cast<size_t>(std::max(m_width - m_cells, 0)));
+            cells = static_cast<int>(text.size());
+        }
+        auto n = std::min(text.size(), m_buf.size() - m_size);
+        std::copy_n(text.data(), n, m_buf.data() + m_size);
+        m_size += n;
+        m_cells += cells;
+    }
+
+    void append(std::string_view text)
+    {
+        append(text, static_cast<int>(text.size()));
+    }
+
+    // Pads with spaces up to column cell, or adds one if it is already past.
+    void pad(int cell)
+    {
+        static const std::string_view spaces = "                                ";
+        if (m_cells > cell) {
+            append(" ");
+        }
+        while (m_cells < cell && m_cells < m_width) {
+            append(spaces.substr(0, static_cast<size_t>(std::min(cell - m_cells, static_cast<int>(spaces.size())))));
+        }
+    }
+
+    void set_width(int width)
+    {
+        m_width = width;
+    }
+
+    void draw(int row, int col) const
+    {
+        move(row, col);
+        addnstr(m_buf.data(), static_cast<int>(m_size));
+        clrtoeol();
+    }
+
+private:
+    std::array<char, 2048> m_buf;
+    size_t m_size = 0;
+    int m_cells = 0;
+    int m_width;
+};
+
+// A table of one line per card and one column per enabled row, for more cards
+// than fit as panels. Rows with a bar get a mini bar in front of their value.
+// Only the visible lines are formatted, each into one table_line. Names are
+// ranked once when the cards are set, so sorting by a row orders integers
+// and sorting by name needs no sorting at all.
+class gpu_table {
+public:
+    explicit gpu_table(const row_set &enabled_rows)
+        : m_columns(enabled_rows.begin(), enabled_rows.end())
+    {
+    }
+
+    void set_cards(std::vector<std::string> names)
+    {
+        m_names = std::move(names);
+        auto count = m_names.size();
+        m_samples.assign(count, sample{});
+        m_limits.assign(count, limits{});
+        m_status.assign(count, std::string_view());
+        m_keys.resize(count);
+
+        m_by_name.resize(count);
+        std::iota(m_by_name.begin(), m_by_name.end(), size_t{0});
+        std::sort(m_by_name.begin(), m_by_name.end(), [this](size_t l, size_t r){
+            return natural_less(m_names[l], m_names[r]);
+        });
+        m_rank.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            m_rank[m_by_name[i]] = i;
+        }
+        m_order = m_by_name;
+
+        m_name_width = 4;
+        for (const auto &name : m_names) {
+            m_name_width = std::max(m_name_width, static_cast<int>(name.size()));
+        }
+        m_sorted = false;
+    }
+
+    size_t size() const
+    {
+        return m_names.size();
+    }
+
+    // Changes the columns, keeping the sort row if it is still shown.
+    void set_rows(const row_set &rows)
+    {
+        auto sort_row = m_sort_column > 0 ? m_columns[m_sort_column - 1] : static_cast<unsigned>(info::row_count);
+        m_columns.assign(rows.begin(), rows.end());
+        auto itr = std::find(m_columns.begin(), m_columns.end(), sort_row);
+        m_sort_column = itr == m_columns.end() ? 0 : static_cast<size_t>(itr - m_columns.begin()) + 1;
+        m_sorted = false;
+    }
+
+    void set(size_t card, const sample &s, const limits &lim)
+    {
+        m_samples[card] = s;
+        m_limits[card] = lim;
+        m_status[card] = {};
+        m_sorted = false;
+    }
+
+    // Shows status in place of the values of card.
+    void set_status(size_t card, std::string_view status)
+    {
+        m_status[card] = status;
+        m_sorted = false;
+    }
+
+    // The up and down arrow, page up and down, home and end keys scroll, unless
+    // scroll_keys is false, < and > or the left and right arrow keys choose
+    // the column to sort by and r reverses the order. Cards are sorted by
+    // name in ascending and by a row in descending order until reversed, with
+    // cards that did not read the row last. Returns false for any other key.
+    bool handle_key(int key, bool scroll_keys = true)
+    {
+        auto page = static_cast<std::int64_t>(std::max(m_lines, 1));
+        std::int64_t scroll = 0;
+        switch (key) {
+        case '<':
+        case KEY_LEFT:
+            m_sort_column = m_sort_column > 0 ? m_sort_column - 1 : m_columns.size();
+            m_sorted = false;
+            return true;
+        case '>':
+        case KEY_RIGHT:
+            m_sort_column = m_sort_column < m_columns.size() ? m_sort_column + 1 : 0;
+            m_sorted = false;
+            return true;
+        case 'r':
+            m_reversed = !m_reversed;
+            m_sorted = false;
+            return true;
+        case KEY_UP:
+            scroll = -1;
+            break;
+        case KEY_DOWN:
+            scroll = 1;
+            break;
+        case KEY_PPAGE:
+            scroll = -page;
+            break;
+        case KEY_NPAGE:
+            scroll = page;
+            break;
+        case KEY_HOME:
+            scroll = -static_cast<std::int64_t>(size());
+            break;
+        case KEY_END:
+            scroll = static_cast<std::int64_t>(size());
+            break;
+        default:
+            return false;
+        }
+        if (!scroll_keys) {
+            return false;
+        }
+        m_top = static_cast<size_t>(std::max<std::int64_t>(static_cast<std::int64_t>(m_top) + scroll, 0));
+        return true;
+    }
+
+    // Draws the header and as many cards as fit on the lines from top up to
+    // bottom and clears the rest. Returns the line after the last card.
+    int draw(int top, int bottom)
+    {
+        sort();
+
+        m_lines = std::max(bottom - top - 1, 0);
+        auto last_top = size() > static_cast<size_t>(m_lines) ? size() - static_cast<size_t>(m_lines) : 0;
+        m_top = std::min(m_top, last_top);
+        auto width = std::max(COLS - hpad, 0);
+        if (top >= bottom) {
+            return top;
+        }
+
+        // The range shown, if not every card fits, goes at the right end.
+        char range[48];
+        int range_size = 0;
+        if (m_top > 0 || last_top > 0) {
+            range_size = std::max(std::snprintf(range, sizeof(range), "  %zu-%zu of %zu", m_top + 1,
+                                                std::min(m_top + static_cast<size_t>(m_lines), size()),
+                                                size()), 0);
+        }
+
+        table_line header(width - range_size);
+        std::string_view up = use_unicode ? "▲" : "^";
+        std::string_view down = use_unicode ? "▼" : "v";
+        int col = 0;
+        for (size_t c = 0; c <= m_columns.size(); ++c) {
+            auto name = c == 0 ? std::string_view("card") : info::metrics[m_columns[c - 1]].name;
+            header.pad(col);
+            header.append(name);
+            if (c == m_sort_column) {
+                header.append((c == 0) != m_reversed ? up : down, 1);
+            }
+            col += c == 0 ? m_name_width + 2 : column_width(m_columns[c - 1]);
+        }
+        if (range_size > 0) {
+            header.set_width(width);
+            header.pad(std::min(col, width - range_size));
+            header.append({range, static_cast<size_t>(range_size)});
+        }
+        attron(A_BOLD);
+        set_color(color::type::label);
+        header.draw(top, hpad);
+        remove_color(color::type::label);
+        attroff(A_BOLD);
+
+        int row = top + 1;
+        for (auto i = m_top; i < size() && row < bottom; ++i, ++row) {
+            draw_card(m_order[i], row, width);
+        }
+        int end = row;
+        for (; row < bottom; ++row) {
+            move(row, 0);
+            clrtoeol();
+        }
+        return end;
+    }
+
+private:
+    static const int mini_bar = 5;
+
+    // Room for the name, the sort mark and values like "123.4 MB/s" with
+    // their mini bar.
+    static int column_width(unsigned row)
+    {
+        auto bar = info::metrics[row].kind == info::display::bar ? mini_bar + 1 : 0;
+        return static_cast<int>(std::max<size_t>(info::metrics[row].name.size() + 1, 10)) + 1 + bar;
+    }
+
+    void draw_card(size_t card, int row, int width) const
+    {
+        table_line line(width);
+        line.append(m_names[card]);
+        int col = m_name_width + 2;
+
+        if (!m_status[card].empty()) {
+            line.pad(col);
+            line.append(m_status[card]);
+            line.draw(row, hpad);
+            return;
+        }
+
+        const auto &s = m_samples[card];
+        for (unsigned r : m_columns) {
+            line.pad(col);
+            if (info::metrics[r].kind == info::display::bar) {
+                append_bar(line, s.has(r) ? fraction(r, s, m_limits[card]) : 0.0);
+            }
+            row_text text;
+            format_cell(r, s, text);
+            line.append(text.view());
+            col += column_width(r);
+        }
+        line.draw(row, hpad);
+    }
+
+    // A bar of mini_bar cells and a space, in eighths of a cell if the
+    // terminal has the block characters.
+    static void append_bar(table_line &line, double fraction)
+    {
+        static const std::string_view eighths[] = {"", "▏", "▎", "▍",
+                                                   "▌", "▋", "▊", "▉"};
+        fraction = std::clamp(fraction, 0.0, 1.0);
+        int cells = 0;
+        if (use_unicode) {
+            auto n = static_cast<int>(fraction * mini_bar * 8 + 0.5);
+            for (; n >= 8; n -= 8, ++cells) {
+                line.append("█", 1);
+            }
+            if (n > 0) {
+                line.append(eighths[n], 1);
+                ++cells;
+            }
+        } else {
+            for (auto n = static_cast<int>(fraction * mini_bar + 0.5); cells < n; ++cells) {
+                line.append("|");
+            }
+        }
+        for (; cells <= mini_bar; ++cells) {
+            line.append(" ");
+        }
+    }
+
+    // Sorts the cards if they changed since the last time.
+    void sort()
+    {
+        if (m_sorted) {
+            return;
+        }
+        m_sorted = true;
+
+        if (m_sort_column == 0) {
+            if (m_reversed) {
+                std::reverse_copy(m_by_name.begin(), m_by_name.end(), m_order.begin());
+            } else {
+                std::copy(m_by_name.begin(), m_by_name.end(), m_order.begin());
+            }
+            return;
+        }
+
+        // Keys sort ascending, with cards that did not read the row last
+        // either way.
+        auto row = m_columns[m_sort_column - 1];
+        for (size_t i = 0; i < size(); ++i) {
+            const auto &s = m_samples[i];
+            bool has = m_status[i].empty() && s.has(row);
+            auto value = has ? s.values[row] : 0;
+            m_keys[i] = {!has, m_reversed ? value : ~value};
+        }
+        std::sort(m_order.begin(), m_order.end(), [this](size_t l, size_t r){
+            return m_keys[l] != m_keys[r] ? m_keys[l] < m_keys[r] : m_rank[l] < m_rank[r];
+        });
+    }
+
+    std::vector<unsigned> m_columns;
+    std::vector<std::string> m_names;
+    std::vector<sample> m_samples;
+    std::vector<struct limits> m_limits;
+    std::vector<std::string_view> m_status;
+    std::vector<size_t> m_rank;
+    std::vector<size_t> m_by_name;
+    std::vector<size_t> m_order;
+    std::vector<std::pair<bool, std::uint64_t>> m_keys;
+    int m_name_width = 4;
+    size_t m_sort_column = 1;
+    bool m_reversed = false;
+    bool m_sorted = false;
+    size_t m_top = 0;
+    int m_lines = 0;
+};
+
+enum class output_format {
+    tui,
+    none,
+    csv,
+    jsonl
+};
+
+void append_number(std::string &out, std::uint64_t value)
+{
+    char buf[24];
+    auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, end);
+}
+
+// Formats samples as CSV or JSON Lines with one line per card. Only the raw
+// values of the samples are written, see struct sample, except for the energy,
+// which is the energy used since gpumon started. A value that could not be
+// read is left empty in CSV and written as null in JSON.
+class stream_writer {
+public:
+    // With summaries, every oversampled row is followed by its min, max and
+    // p95 over the update interval as <row>_min, <row>_max and <row>_p95.
+    stream_writer(int fd, output_format format, const std::vector<device> &devices,
+                  const row_set &enabled_rows, bool summaries)
+        : m_fd(fd)
+        , m_format(format)
+        , m_devices(devices)
+        , m_enabled_rows(enabled_rows)
+        , m_summaries(summaries)
+    {
+        m_buffer.reserve(512 * devices.size());
+    }
+
+    bool write_header()
+    {
+        if (m_format != output_format::csv) {
+            return true;
+        }
+
+        m_buffer = "time,card";
+        for (unsigned row : m_enabled_rows) {
+            m_buffer.append(1, ',').append(row_name(row));
+            if (m_summaries && oversampled_index(row) >= 0) {
+                for (auto suffix : summary_suffixes) {
+                    m_buffer.append(1, ',').append(row_name(row)).append(suffix);
+                }
+            }
+        }
+        m_buffer.append(1, '\n');
+        return flush();
+    }
+
+    bool write(const frame &f)
+    {
+        m_buffer.clear();
+        for (size_t i = 0; i < m_devices.size(); ++i) {
+            auto s = with_derived(f.samples[i], f.derived[i]);
+            if (m_format == output_format::csv) {
+                append_csv(m_devices[i], s, f.aggregates[i]);
+            } else {
+                append_json(m_devices[i], s, f.aggregates[i]);
+            }
+        }
+        return flush();
+    }
+
+private:
+    static constexpr std::string_view summary_suffixes[] = {"_min", "_max", "_p95"};
+
+    static std::array<std::uint64_t, 3> summary_values(const summary &sum)
+    {
+        return {sum.min, sum.max, sum.p95};
+    }
+
+    void append_csv(const device &dev, const sample &s, const aggregate &agg)
+    {
+        append_number(m_buffer, s.time);
+        m_buffer.append(1, ',').append(dev.name());
+        for (unsigned row : m_enabled_rows) {
+            m_buffer.append(1, ',');
+            if (s.has(row)) {
+                append_number(m_buffer, s.values[row]);
+            }
+
+            auto index = oversampled_index(row);
+            if (!m_summaries || index < 0) {
+                continue;
+            }
+            auto i = static_cast<size_t>(index);
+            for (auto value : summary_values(agg.rows[i])) {
+                m_buffer.append(1, ',');
+                if (agg.counts[i] > 0) {
+                    append_number(m_buffer, value);
+                }
+            }
+        }
+        m_buffer.append(1, '\n');
+    }
+
+    void append_json(const device &dev, const sample &s, const aggregate &agg)
+    {
+        m_buffer.append("{\"time\":");
+        append_number(m_buffer, s.time);
+        m_buffer.append(",\"card\":\"").append(dev.name()).append(1, '"');
+        for (unsigned row : m_enabled_rows) {
+            m_buffer.append(",\"").append(row_name(row)).append("\":");
+            if (s.has(row)) {
+                append_number(m_buffer, s.values[row]);
+            } else {
+                m_buffer.append("null");
+            }
+
+            auto index = oversampled_index(row);
+            if (!m_summaries || index < 0) {
+                continue;
+            }
+            auto i = static_cast<size_t>(index);
+            auto values = summary_values(agg.rows[i]);
+            for (size_t v = 0; v < values.size(); ++v) {
+                m_buffer.append(",\"").append(row_name(row)).append(summary_suffixes[v]).append("\":");
+                if (agg.counts[i] > 0) {
+                    append_number(m_buffer, values[v]);
+                } else {
+                    m_buffer.append("null");
+                }
+            }
+        }
+        m_buffer.append("}\n");
+    }
+
+    bool flush()
+    {
+        return write_all(m_fd, m_buffer.data(), m_buffer.size());
+    }
+
+    int m_fd;
+    output_format m_format;
+    const std::vector<device> &m_devices;
+    const row_set &m_enabled_rows;
+    bool m_summaries;
+    std::string m_buffer;
+};
+
+// Appends value / divisor with as many decimals as the divisor has zeros,
+// e.g. 45000000 / 1000000 as "45.000000", without going through floating
+// point.
+void append_fixed(std::string &out, std::uint64_t value, std::uint64_t divisor)
+{
+    append_number(out, value / divisor);
+    if (divisor == 1) {
+        return;
+    }
+
+    out.append(1, '.');
+    for (auto d = divisor / 10; d > 0; d /= 10) {
+        out.append(1, static_cast<char>('0' + value % divisor / d % 10));
+    }
+}
+
+// Splits address, given as HOST:PORT, [HOST]:PORT or :PORT, into its host and
+// port, or returns false if it has no port.
+bool split_address(std::string_view address, std::string &host, std::string &port)
+{
+    auto colon = address.rfind(':');
+    if (colon == std::string_view::npos) {
+        return false;
+    }
+
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    return true;
+}
+
+// Returns a non-blocking socket listening on address, which may have an empty
+// host for all addresses, or -1 after printing why it could not listen.
+int listen_socket(std::string_view address)
+{
+    std::string host, port;
+    if (!split_address(address, host, port)) {
+        std::cerr << "invalid address '" << address << "', expected HOST:PORT\n";
+        return -1;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    addrinfo *result;
+    auto err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    if (err != 0) {
+        std::cerr << address << ": " << gai_strerror(err) << '\n';
+        return -1;
+    }
+
+    // Prefer IPv6 so that an empty host also accepts IPv4 clients.
+    int listen_fd = -1;
+    for (int family : {AF_INET6, AF_INET}) {
+        for (auto *ai = result; ai && listen_fd < 0; ai = ai->ai_next) {
+            if (ai->ai_family != family) {
+                continue;
+            }
+
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+
+            int one = 1, zero = 0;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (family == AF_INET6) {
+                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+            }
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 64) == 0) {
+                listen_fd = fd;
+            } else {
+                ::close(fd);
+            }
+        }
+    }
+    freeaddrinfo(result);
+
+    if (listen_fd < 0) {
+        std::cerr << address << ": " << std::strerror(errno) << '\n';
+    }
+    return listen_fd;
+}
+
+// Serves the newest samples of every card as OpenMetrics text over a minimal
+// HTTP listener. The body is rendered once per published frame into a reused
+// buffer, so a scrape never causes a sysfs read and many scrapers cost no more
+// on the GPU side than one.
+class metrics_server {
+public:
+    metrics_server(event_loop &loop, const std::vector<device> &devices,
+                   const row_set &enabled_rows)
+        : m_loop(loop)
+        , m_devices(devices)
+        , m_enabled_rows(enabled_rows)
+    {
+    }
+
+    metrics_server(const metrics_server &) = delete;
+    metrics_server &operator=(const metrics_server &) = delete;
+
+    ~metrics_server()
+    {
+        for (const auto &[fd, c] : m_clients) {
+            m_loop.remove(fd);
+            ::close(fd);
+        }
+        if (m_listen_fd >= 0) {
+            m_loop.remove(m_listen_fd);
+            ::close(m_listen_fd);
+        }
+    }
+
+    // Listens on address, see listen_socket().
+    bool listen(std::string_view address)
+    {
+        m_listen_fd = listen_socket(address);
+        if (m_listen_fd < 0) {
+            return false;
+        }
+
+        m_loop.add(m_listen_fd, EPOLLIN, [this](std::uint32_t){ accept_clients(); });
+        return true;
+    }
+
+    void update(const frame &f)
+    {
+        auto body = spare_body();
+        render(*body, f);
+        m_body = std::move(body);
+    }
+
+private:
+    struct client {
+        std::array<char, 2048> request;
+        size_t received = 0;
+        std::array<char, 256> header;
+        size_t header_size = 0;
+        std::shared_ptr<const std::string> body;
+        size_t sent = 0;
+    };
+
+    static const size_t max_clients = 256;
+
+    // Returns a body buffer that no client is still sending from. Buffers
+    // are recycled, so once every buffer has grown to size no allocation
+    // happens.
+    std::shared_ptr<std::string> spare_body()
+    {
+        for (auto &body : m_bodies) {
+            if (body.use_count() == 1) {
+                body->clear();
+                return body;
+            }
+        }
+        return m_bodies.emplace_back(std::make_shared<std::string>());
+    }
+
+    void render(std::string &out, const frame &f) const
+    {
+        for (unsigned row : m_enabled_rows) {
+            const auto &metric = info::metrics[row];
+            out.append("# TYPE ").append(metric.export_name).append(" gauge\n");
+            out.append("# HELP ").append(metric.export_name).append(1, ' ').append(metric.help).append(1, '\n');
+            for (size_t i = 0; i < m_devices.size(); ++i) {
+                auto s = with_derived(f.samples[i], f.derived[i]);
+                if (!s.has(row)) {
+                    continue;
+                }
+                out.append(metric.export_name).append("{card=\"").append(m_devices[i].name()).append("\"} ");
+                append_fixed(out, s.values[row] * metric.export_multiplier, metric.export_divisor);
+                out.append(1, '\n');
+            }
+        }
+
+        for (size_t r = 0; r < dpm_count; ++r) {
+            if (m_enabled_rows.test(dpm_rows[r])) {
+                render_residency(out, f, r);
+            }
+        }
+
+        render_limit(out, f, "gpumon_vram_total_bytes", "Total VRAM", &limits::vram, 1);
+        render_limit(out, f, "gpumon_gtt_total_bytes", "Total GTT memory", &limits::gtt, 1);
+        render_limit(out, f, "gpumon_power_cap_watts", "Maximum power cap", &limits::power_max, 1000000);
+        render_limit(out, f, "gpumon_temperature_critical_celsius", "Critical temperature",
+                     &limits::temp_crit, 1000);
+
+        out.append("# EOF\n");
+    }
+
+    // The time spent at each level of a DPM row as e.g.
+    // gpumon_sclk_dpm_level_seconds{card="card0",level="1"}.
+    void render_residency(std::string &out, const frame &f, size_t index) const
+    {
+        const auto &metric = info::metrics[dpm_rows[index]];
+        out.append("# TYPE ").append(metric.export_name).append("_seconds gauge\n");
+        out.append("# HELP ").append(metric.export_name).append("_seconds Time spent at each level since gpumon started\n");
+        for (size_t i = 0; i < m_devices.size(); ++i) {
+            const auto &d = f.derived[i];
+            for (unsigned level = 0; level < d.levels[index]; ++level) {
+                out.append(metric.export_name).append("_seconds{card=\"").append(m_devices[i].name());
+                out.append("\",level=\"");
+                append_number(out, level);
+                out.append("\"} ");
+                append_fixed(out, static_cast<std::uint64_t>(d.level_ns[index][level]), 1000000000);
+                out.append(1, '\n');
+            }
+        }
+    }
+
+    void render_limit(std::string &out, const frame &f, std::string_view name, std::string_view help,
+                      std::uint64_t limits::*field, std::uint64_t divisor) const
+    {
+        out.append("# TYPE ").append(name).append(" gauge\n");
+        out.append("# HELP ").append(name).append(1, ' ').append(help).append(1, '\n');
+        for (size_t i = 0; i < m_devices.size(); ++i) {
+            auto value = f.limits[i].*field;
+            if (value == 0) {
+                continue;
+            }
+            out.append(name).append("{card=\"").append(m_devices[i].name()).append("\"} ");
+            append_fixed(out, value, divisor);
+            out.append(1, '\n');
+        }
+    }
+
+    void accept_clients()
+    {
+        int fd;
+        while ((fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            if (m_clients.size() >= max_clients) {
+                ::close(fd);
+                continue;
+            }
+            m_clients.emplace(fd, std::make_unique<client>());
+            m_loop.add(fd, EPOLLIN, [this, fd](std::uint32_t events){ handle_client(fd, events); });
+        }
+    }
+
+    void close_client(int fd)
+    {
+        m_loop.remove(fd);
+        m_clients.erase(fd);
+        ::close(fd);
+    }
+
+    void handle_client(int fd, std::uint32_t events)
+    {
+        auto &c = *m_clients.at(fd);
+
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            close_client(fd);
+            return;
+        }
+
+        if (!c.body) {
+            auto n = ::read(fd, c.request.data() + c.received, c.request.size() - c.received);
+            if (n <= 0) {
+                if (n == 0 || errno != EAGAIN) {
+                    close_client(fd);
+                }
+                return;
+            }
+            c.received += static_cast<size_t>(n);
+
+            std::string_view request(c.request.data(), c.received);
+            if (request.find("\r\n\r\n") == std::string_view::npos) {
+                if (c.received == c.request.size()) {
+                    close_client(fd);
+                }
+                return;
+            }
+            respond(c, request);
+            m_loop.modify(fd, EPOLLOUT);
+        }
+
+        if (!send(fd, c)) {
+            close_client(fd);
+        }
+    }
+
+    void respond(client &c, std::string_view request)
+    {
+        static const std::string not_found = "Not found\n";
+        static const std::string not_ready = "No samples yet\n";
+
+        // Until the first update, scrapers get an error rather than an
+        // empty exposition.
+        bool found = request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0;
+        bool ok = found && m_body;
+        c.body = ok ? m_body : std::shared_ptr<const std::string>(m_body, found ? &not_ready : &not_found);
+
+        auto n = std::snprintf(c.header.data(), c.header.size(),
+            "HTTP/1.1 %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n",
+            ok ? "200 OK" : found ? "503 Service Unavailable" : "404 Not Found",
+            ok ? "application/openmetrics-text; version=1.0.0; charset=utf-8" : "text/plain",
+            c.body->size());
+        c.header_size = static_cast<size_t>(n);
+    }
+
+    // Returns false once the response has been sent or the client is gone.
+    bool send(int fd, client &c)
+    {
+        while (true) {
+            iovec parts[2];
+            size_t count = 0;
+            if (c.sent < c.header_size) {
+                parts[count++] = {c.header.data() + c.sent, c.header_size - c.sent};
+            }
+            auto body_sent = c.sent > c.header_size ? c.sent - c.header_size : 0;
+            if (body_sent < c.body->size()) {
+                parts[count++] = {const_cast<char *>(c.body->data()) + body_sent, c.body->size() - body_sent};
+            }
+            if (count == 0) {
+                return false;
+            }
+
+            auto n = ::writev(fd, parts, static_cast<int>(count));
+            if (n < 0) {
+                return errno == EAGAIN;
+            }
+            c.sent += static_cast<size_t>(n);
+        }
+    }
+
+    event_loop &m_loop;
+    const std::vector<device> &m_devices;
+    const row_set &m_enabled_rows;
+    int m_listen_fd = -1;
+    std::vector<std::shared_ptr<std::string>> m_bodies;
+    std::shared_ptr<const std::string> m_body;
+    std::unordered_map<int, std::unique_ptr<client>> m_clients;
+};
+
+// A recording, as written by --record, is a record_header, one record_card per
+// card and then one fixed-size record per update. A record holds the sample of
+// every card, then the limits of every card, which are refreshed while
+// sampling, and the aggregate of every card if the recording was
+// oversampled. Everything is stored in native byte order, so a recording can
+// only be replayed on the kind of machine it was made on, and any record is
+// found from its index alone.
+const char record_magic[8] = {'g', 'p', 'u', 'm', 'o', 'n', 'r', 'c'};
+const std::uint32_t record_version = 3;
+
+struct record_header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t card_count;
+    std::uint32_t row_count;
+    std::uint32_t rows; // one bit per enabled row
+    std::uint32_t oversampled;
+    std::uint32_t record_size;
+    std::int64_t interval; // nanoseconds
+};
+
+struct record_card {
+    char name[32];
+    std::uint32_t supported; // one bit per supported row
+    std::uint32_t reserved;
+    struct limits limits;
+};
+
+size_t record_size(size_t cards, bool oversampled)
+{
+    return cards * (sizeof(sample) + sizeof(struct limits) + (oversampled ? sizeof(aggregate) : 0));
+}
+
+// Lays frames out in the recording format, for --record and --agent.
+// Encoding a frame copies it into a buffer that is allocated once.
+class record_encoder {
+public:
+    record_encoder(const std::vector<device> &devices, const row_set &enabled_rows,
+                   std::int64_t interval, bool oversampled)
+        : m_devices(devices)
+        , m_enabled_rows(enabled_rows)
+        , m_interval(interval)
+        , m_oversampled(oversampled)
+        , m_buffer(record_size(devices.size(), oversampled))
+    {
+    }
+
+    // The record_header followed by the record_card of every card, which
+    // carries its limits at the time.
+    std::vector<char> header(const std::vector<struct limits> &limits) const
+    {
+        record_header header = {};
+        std::memcpy(header.magic, record_magic, sizeof(header.magic));
+        header.version = record_version;
+        header.card_count = static_cast<std::uint32_t>(m_devices.size());
+        header.row_count = info::row_count;
+        header.oversampled = m_oversampled;
+        header.record_size = static_cast<std::uint32_t>(m_buffer.size());
+        header.interval = m_interval;
+        header.rows = m_enabled_rows.mask();
+
+        std::vector<char> out(sizeof(header) + m_devices.size() * sizeof(record_card));
+        for (size_t i = 0; i < m_devices.size(); ++i) {
+            record_card card = {};
+            m_devices[i].name().copy(card.name, sizeof(card.name) - 1);
+            card.limits = limits[i];
+            for (unsigned row = 0; row < info::row_count; ++row) {
+                card.supported |= m_devices[i].supports(row) ? 1u << row : 0;
+            }
+            std::memcpy(out.data() + sizeof(header) + i * sizeof(card), &card, sizeof(card));
+        }
+        std::memcpy(out.data(), &header, sizeof(header));
+        return out;
+    }
+
+    // The record of f, valid until the next call.
+    std::string_view encode(const frame &f)
+    {
+        auto *out = m_buffer.data();
+        std::memcpy(out, f.samples.data(), f.samples.size() * sizeof(sample));
+        out += f.samples.size() * sizeof(sample);
+        std::memcpy(out, f.limits.data(), f.limits.size() * sizeof(struct limits));
+        if (m_oversampled) {
+            out += f.limits.size() * sizeof(struct limits);
+            std::memcpy(out, f.aggregates.data(), f.aggregates.size() * sizeof(aggregate));
+        }
+        return {m_buffer.data(), m_buffer.size()};
+    }
+
+private:
+    const std::vector<device> &m_devices;
+    const row_set &m_enabled_rows;
+    std::int64_t m_interval;
+    bool m_oversampled;
+    std::vector<char> m_buffer;
+};
+
+// Appends every frame to a recording with a single write.
+class recorder {
+public:
+    recorder(int fd, const std::vector<device> &devices, const row_set &enabled_rows,
+             const sampler_config &config, bool oversampled)
+        : m_fd(fd)
+        , m_devices(devices)
+        , m_encoder(devices, enabled_rows, config.interval, oversampled)
+    {
+    }
+
+    bool write_header()
+    {
+        std::vector<struct limits> limits;
+        for (const auto &dev : m_devices) {
+            limits.push_back(dev.limits());
+        }
+        auto out = m_encoder.header(limits);
+        return write_all(m_fd, out.data(), out.size());
+    }
+
+    bool write(const frame &f)
+    {
+        auto record = m_encoder.encode(f);
+        return write_all(m_fd, record.data(), record.size());
+    }
+
+private:
+    int m_fd;
+    const std::vector<device> &m_devices;
+    record_encoder m_encoder;
+};
+
+// Streams a recording over TCP to every client of --agent: the header when it
+// connects, with the limits of the last frame, and then one record per frame.
+// A client that is still sending the previous record skips a frame rather
+// than queueing it, and one that has skipped max_skipped frames in a row is
+// dropped, so a stalled collector costs neither memory nor the other clients
+// anything.
+class agent_server {
+public:
+    agent_server(event_loop &loop, const std::vector<device> &devices, const row_set &enabled_rows,
+                 const sampler_config &config, bool oversampled)
+        : m_loop(loop)
+        , m_encoder(devices, enabled_rows, config.interval, oversampled)
+    {
+        for (const auto &dev : devices) {
+            m_limits.push_back(dev.limits());
+        }
+    }
+
+    agent_server(const agent_server &) = delete;
+    agent_server &operator=(const agent_server &) = delete;
+
+    ~agent_server()
+    {
+        for (const auto &[fd, c] : m_clients) {
+            m_loop.remove(fd);
+            ::close(fd);
+        }
+        if (m_listen_fd >= 0) {
+            m_loop.remove(m_listen_fd);
+            ::close(m_listen_fd);
+        }
+    }
+
+    // Listens on address, see listen_socket().
+    bool listen(std::string_view address)
+    {
+        m_listen_fd = listen_socket(address);
+        if (m_listen_fd < 0) {
+            return false;
+        }
+
+        m_loop.add(m_listen_fd, EPOLLIN, [this](std::uint32_t){ accept_clients(); });
+        return true;
+    }
+
+    void update(const frame &f)
+    {
+        std::copy(f.limits.begin(), f.limits.end(), m_limits.begin());
+        auto record = m_encoder.encode(f);
+
+        for (auto itr = m_clients.begin(); itr != m_clients.end();) {
+            auto &[fd, c] = *itr;
+            bool ok = true;
+            if (c.sent == c.out.size()) {
+                c.out.assign(record.begin(), record.end());
+                c.sent = 0;
+                c.skipped = 0;
+                ok = send(fd, c);
+            } else {
+                ok = ++c.skipped < max_skipped;
+            }
+
+            if (ok) {
+                ++itr;
+            } else {
+                m_loop.remove(fd);
+                ::close(fd);
+                itr = m_clients.erase(itr);
+            }
+        }
+    }
+
+private:
+    struct client {
+        std::vector<char> out;
+        size_t sent = 0;
+        unsigned skipped = 0;
+        bool waiting = false; // for EPOLLOUT
+    };
+
+    static const size_t max_clients = 256;
+    static const unsigned max_skipped = 60;
+
+    void accept_clients()
+    {
+        int fd;
+        while ((fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            if (m_clients.size() >= max_clients) {
+                ::close(fd);
+                continue;
+            }
+
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            auto &c = m_clients[fd];
+            c.out = m_encoder.header(m_limits);
+            m_loop.add(fd, EPOLLIN, [this, fd](std::uint32_t events){ handle_client(fd, events); });
+            if (!send(fd, c)) {
+                close_client(fd);
+            }
+        }
+    }
+
+    void close_client(int fd)
+    {
+        m_loop.remove(fd);
+        m_clients.erase(fd);
+        ::close(fd);
+    }
+
+    // Collectors never send anything, so readable only means that one went
+    // away.
+    void handle_client(int fd, std::uint32_t events)
+    {
+        auto &c = m_clients.at(fd);
+
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            close_client(fd);
+            return;
+        }
+
+        if (events & EPOLLIN) {
+            char buf[256];
+            auto n = ::read(fd, buf, sizeof(buf));
+            if (n == 0 || (n < 0 && errno != EAGAIN)) {
+                close_client(fd);
+                return;
+            }
+        }
+
+        if ((events & EPOLLOUT) && !send(fd, c)) {
+            close_client(fd);
+        }
+    }
+
+    // Sends as much of the pending output as the socket takes and waits for
+    // EPOLLOUT while some is left. Returns false if the client is gone.
+    bool send(int fd, client &c)
+    {
+        while (c.sent < c.out.size()) {
+            auto n = ::send(fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno != EAGAIN) {
+                    return false;
+                }
+                break;
+            }
+            c.sent += static_cast<size_t>(n);
+        }
+
+        bool waiting = c.sent < c.out.size();
+        if (waiting != c.waiting) {
+            m_loop.modify(fd, waiting ? EPOLLIN | EPOLLOUT : EPOLLIN);
+            c.waiting = waiting;
+        }
+        return true;
+    }
+
+    event_loop &m_loop;
+    record_encoder m_encoder;
+    std::vector<struct limits> m_limits;
+    int m_listen_fd = -1;
+    std::unordered_map<int, client> m_clients;
+};
+
+// Plays a recording back through the interface of the sampler, so the display
+// cannot tell the two apart. The file is mapped rather than read, and because
+// every record has the same size, seeking to a point in time is an estimate
+// from the average record spacing followed by a step or two to the exact
+// record.
+class player {
+public:
+    player() = default;
+
+    player(const player &) = delete;
+    player &operator=(const player &) = delete;
+
+    ~player()
+    {
+        if (m_data) {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+    }
+
+    bool open(const char *path)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(path);
+            return false;
+        }
+
+        struct stat st;
+        void *data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            std::cerr << path << ": could not map the recording\n";
+            return false;
+        }
+        m_data = static_cast<const char *>(data);
+        m_size = static_cast<size_t>(st.st_size);
+
+        if (m_size < sizeof(m_header)) {
+            std::cerr << path << ": not a gpumon recording\n";
+            return false;
+        }
+        std::memcpy(&m_header, m_data, sizeof(m_header));
+        if (std::memcmp(m_header.magic, record_magic, sizeof(record_magic)) != 0) {
+            std::cerr << path << ": not a gpumon recording\n";
+            return false;
+        }
+
+        m_records = sizeof(m_header) + m_header.card_count * sizeof(record_card);
+        if (m_header.version != record_version || m_header.row_count != info::row_count ||
+            m_header.card_count == 0 ||
+            m_header.record_size != record_size(m_header.card_count, m_header.oversampled) ||
+            m_size < m_records) {
+            std::cerr << path << ": unsupported recording format\n";
+            return false;
+        }
+
+        // A record cut short by a crash while recording is ignored.
+        m_count = (m_size - m_records) / m_header.record_size;
+        if (m_count == 0) {
+            std::cerr << path << ": the recording is empty\n";
+            return false;
+        }
+        m_spacing = m_count > 1 ? (time(m_count - 1) - time(0)) / (m_count - 1) : 0;
+
+        m_frame.samples.resize(m_header.card_count);
+        m_frame.aggregates.resize(m_header.card_count);
+        m_frame.derived.resize(m_header.card_count);
+        m_rates = rate_stage(m_header.card_count);
+        for (const auto &dev : devices()) {
+            m_frame.limits.push_back(dev.limits());
+        }
+        return true;
+    }
+
+    // Devices that carry the names, limits and supported rows of the recorded
+    // cards, without reading sysfs.
+    std::vector<device> devices() const
+    {
+        std::vector<device> out;
+        for (size_t i = 0; i < m_header.card_count; ++i) {
+            record_card card;
+            std::memcpy(&card, m_data + sizeof(m_header) + i * sizeof(card), sizeof(card));
+            card.name[sizeof(card.name) - 1] = '\0';
+            out.emplace_back(card.name, card.limits, card.supported);
+        }
+        return out;
+    }
+
+    bool recorded(unsigned row) const
+    {
+        return m_header.rows & (1u << row);
+    }
+
+    std::int64_t interval() const
+    {
+        return m_header.interval;
+    }
+
+    bool oversampling() const
+    {
+        return m_header.oversampled;
+    }
+
+    void start()
+    {
+        m_timer.set_period(std::max(interval() > 0 ? interval() : std::int64_t{1000000000}, min_interval));
+    }
+
+    void stop()
+    {
+        m_timer.set_period(0);
+    }
+
+    int fd() const
+    {
+        return m_timer.fd();
+    }
+
+    // Advances by speed records per elapsed interval unless paused.
+    void drain()
+    {
+        auto expiries = m_timer.read();
+        if (!m_paused) {
+            step(static_cast<std::int64_t>(expiries * m_speed));
+        }
+    }
+
+    bool update()
+    {
+        if (m_shown == m_position) {
+            return false;
+        }
+
+        // Derived values are computed from every record played, also from
+        // the ones skipped at a higher speed, and start over after a seek.
+        m_jumped = m_position != m_shown + 1;
+        auto first = m_shown + 1;
+        if (m_position < m_shown || m_position - m_shown > max_speed) {
+            m_rates.reset();
+            first = m_position;
+        }
+        m_shown = m_position;
+
+        auto cards = m_frame.samples.size();
+        for (auto position = first; position <= m_position; ++position) {
+            auto *record = m_data + m_records + position * m_header.record_size;
+            std::memcpy(m_frame.samples.data(), record, cards * sizeof(sample));
+            for (size_t i = 0; i < cards; ++i) {
+                const auto &s = m_frame.samples[i];
+                m_rates.update(i, s, static_cast<std::int64_t>(s.time) * 1000000, m_frame.derived[i]);
+            }
+        }
+
+        auto *record = m_data + m_records + m_position * m_header.record_size + cards * sizeof(sample);
+        std::memcpy(m_frame.limits.data(), record, cards * sizeof(struct limits));
+        if (oversampling()) {
+            record += cards * sizeof(struct limits);
+            std::memcpy(m_frame.aggregates.data(), record, cards * sizeof(aggregate));
+        }
+        return true;
+    }
+
+    const frame &current() const
+    {
+        return m_frame;
+    }
+
+    // Whether the frame made current by the last update() does not directly
+    // follow the one before it.
+    bool jumped() const
+    {
+        return m_jumped;
+    }
+
+    // Space pauses, the arrow keys seek by ten seconds and page up and down
+    // by ten minutes, home and end jump to either end and + and - change the
+    // playback speed. Returns false for any other key.
+    bool handle_key(int key)
+    {
+        switch (key) {
+        case ' ':
+            m_paused = !m_paused;
+            break;
+        case KEY_LEFT:
+            seek(-10000);
+            break;
+        case KEY_RIGHT:
+            seek(10000);
+            break;
+        case KEY_PPAGE:
+            seek(-600000);
+            break;
+        case KEY_NPAGE:
+            seek(600000);
+            break;
+        case KEY_HOME:
+            m_position = 0;
+            break;
+        case KEY_END:
+            m_position = m_count - 1;
+            break;
+        case '+':
+            m_speed = std::min(m_speed * 2, max_speed);
+            break;
+        case '-':
+            m_speed = std::max(m_speed / 2, 1u);
+            break;
+        default:
+            return false;
+        }
+        return true;
+    }
+
+    std::string_view status()
+    {
+        auto t = static_cast<time_t>(time(m_position) / 1000);
+        tm local;
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &local));
+
+        auto n = std::snprintf(m_status.data(), m_status.size(), "replay %s  %zu/%zu  %ux%s",
+                               when, m_position + 1, m_count, m_speed, m_paused ? "  paused" : "");
+        return {m_status.data(), static_cast<size_t>(std::max(n, 0))};
+    }
+
+private:
+    static constexpr unsigned max_speed = 1024;
+
+    // The timestamp of the first card in the record, in milliseconds.
+    std::uint64_t time(size_t index) const
+    {
+        std::uint64_t t;
+        std::memcpy(&t, m_data + m_records + index * m_header.record_size + offsetof(sample, time), sizeof(t));
+        return t;
+    }
+
+    void step(std::int64_t records)
+    {
+        auto last = static_cast<std::int64_t>(m_count - 1);
+        auto position = std::clamp(static_cast<std::int64_t>(m_position) + records, std::int64_t{0}, last);
+        m_position = static_cast<size_t>(position);
+        if (position == last) {
+            m_paused = true;
+        }
+    }
+
+    // Moves to the last record at or before the current time plus delta.
+    void seek(std::int64_t delta_ms)
+    {
+        auto target = static_cast<std::int64_t>(time(m_position)) + delta_ms;
+        auto position = m_position;
+        if (m_spacing > 0) {
+            auto estimate = static_cast<std::int64_t>(m_position) + delta_ms / static_cast<std::int64_t>(m_spacing);
+            position = static_cast<size_t>(std::clamp(estimate, std::int64_t{0},
+                                                      static_cast<std::int64_t>(m_count - 1)));
+        }
+
+        while (position > 0 && static_cast<std::int64_t>(time(position)) > target) {
+            --position;
+        }
+        while (position + 1 < m_count && static_cast<std::int64_t>(time(position + 1)) <= target) {
+            ++position;
+        }
+        m_position = position;
+    }
+
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    record_header m_header = {};
+    size_t m_records = 0; // offset of the first record
+    size_t m_count = 0;
+    std::uint64_t m_spacing = 0;
+
+    timer_fd m_timer;
+    frame m_frame;
+    rate_stage m_rates;
+    size_t m_position = 0;
+    size_t m_shown = static_cast<size_t>(-1);
+    bool m_jumped = false;
+    bool m_paused = false;
+    unsigned m_speed = 1;
+    std::array<char, 96> m_status;
+};
+
+// The port of --agent and --collect when none is given.
+const char default_agent_port[] = "7411";
+
+// Receives the streams of the agents given to --collect and keeps the latest
+// sample of each of their cards, and the values derived from all of them. Every agent is connected to without blocking
+// from one event loop, and one that cannot be reached or goes away is retried
+// every retry_interval. An agent's buffers are allocated when its header
+// arrives, so receiving samples never allocates.
+class collector {
+public:
+    struct agent {
+        std::string label;
+        sockaddr_storage address = {};
+        socklen_t address_size = 0;
+        int fd = -1;
+        bool connected = false; // the header has been received
+        std::string_view status = "connecting";
+        record_header header = {};
+        std::vector<std::string> names;
+        std::vector<struct limits> limits;
+        std::vector<sample> samples;
+        std::vector<derived_values> derived;
+        rate_stage rates;
+        std::vector<char> buffer;
+        size_t received = 0;
+        std::int64_t retry_ns = 0;
+    };
+
+    // A row of the table: a card of an agent, or an agent whose cards are not
+    // known yet with a card of no_card.
+    struct gpu {
+        size_t agent;
+        size_t card;
+    };
+
+    static constexpr size_t no_card = static_cast<size_t>(-1);
+
+    explicit collector(event_loop &loop)
+        : m_loop(loop)
+    {
+    }
+
+    collector(const collector &) = delete;
+    collector &operator=(const collector &) = delete;
+
+    ~collector()
+    {
+        for (auto &a : m_agents) {
+            close(a);
+        }
+    }
+
+    // Resolves address, HOST or HOST:PORT, once up front.
+    bool add(std::string_view address)
+    {
+        std::string host, port;
+        if (!split_address(address, host, port)) {
+            host = address;
+            port = default_agent_port;
+        }
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo *result;
+        auto err = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+        if (err != 0) {
+            std::cerr << address << ": " << gai_strerror(err) << '\n';
+            return false;
+        }
+
+        auto &a = m_agents.emplace_back();
+        a.label = address;
+        std::memcpy(&a.address, result->ai_addr, result->ai_addrlen);
+        a.address_size = result->ai_addrlen;
+        freeaddrinfo(result);
+        m_layout_changed = true;
+        ++m_generation;
+        return true;
+    }
+
+    // Connects to every agent that is not connected and due for a retry. No
+    // agent may be added after the first call.
+    void connect()
+    {
+        auto now = monotonic_ns();
+        for (size_t i = 0; i < m_agents.size(); ++i) {
+            auto &a = m_agents[i];
+            if (a.fd >= 0 || now < a.retry_ns) {
+                continue;
+            }
+
+            a.fd = socket(a.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (a.fd < 0) {
+                disconnect(a, std::strerror(errno));
+                continue;
+            }
+            if (::connect(a.fd, reinterpret_cast<const sockaddr *>(&a.address), a.address_size) < 0 &&
+                errno != EINPROGRESS) {
+                disconnect(a, std::strerror(errno));
+                continue;
+            }
+
+            a.status = "connecting";
+            a.received = 0;
+            a.buffer.resize(sizeof(record_header));
+            m_loop.add(a.fd, EPOLLIN, [this, i](std::uint32_t events){ handle(m_agents[i], events); });
+        }
+    }
+
+    const std::vector<agent> &agents() const
+    {
+        return m_agents;
+    }
+
+    size_t connected() const
+    {
+        return static_cast<size_t>(std::count_if(m_agents.begin(), m_agents.end(),
+                                                 [](const agent &a){ return a.connected; }));
+    }
+
+    // Every card of every agent, in the order the agents were added. The list
+    // only changes when an agent connects with a different set of cards.
+    const std::vector<gpu> &gpus()
+    {
+        if (m_layout_changed) {
+            m_gpus.clear();
+            for (size_t i = 0; i < m_agents.size(); ++i) {
+                auto cards = m_agents[i].names.size();
+                if (cards == 0) {
+                    m_gpus.push_back({i, no_card});
+                }
+                for (size_t card = 0; card < cards; ++card) {
+                    m_gpus.push_back({i, card});
+                }
+            }
+            m_layout_changed = false;
+        }
+        return m_gpus;
+    }
+
+    // Changes whenever gpus() does.
+    std::uint64_t generation() const
+    {
+        return m_generation;
+    }
+
+    // The records received so far.
+    std::uint64_t updates() const
+    {
+        return m_updates;
+    }
+
+    static const std::int64_t retry_interval = 5000000000ll;
+
+private:
+    static const std::uint32_t max_cards = 4096;
+
+    void close(agent &a)
+    {
+        if (a.fd >= 0) {
+            m_loop.remove(a.fd);
+            ::close(a.fd);
+            a.fd = -1;
+        }
+    }
+
+    void disconnect(agent &a, std::string_view status)
+    {
+        close(a);
+        a.connected = false;
+        a.status = status;
+        a.retry_ns = monotonic_ns() + retry_interval;
+    }
+
+    void handle(agent &a, std::uint32_t events)
+    {
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            int err = 0;
+            socklen_t size = sizeof(err);
+            getsockopt(a.fd, SOL_SOCKET, SO_ERROR, &err, &size);
+            disconnect(a, err ? std::strerror(err) : "connection closed");
+            return;
+        }
+
+        while (true) {
+            auto n = ::read(a.fd, a.buffer.data() + a.received, a.buffer.size() - a.received);
+            if (n <= 0) {
+                if (n == 0 || errno != EAGAIN) {
+                    disconnect(a, n == 0 ? "connection closed" : std::strerror(errno));
+                }
+                return;
+            }
+            a.received += static_cast<size_t>(n);
+            if (!(a.connected ? receive_records(a) : receive_header(a))) {
+                disconnect(a, "not a compatible gpumon agent");
+                return;
+            }
+        }
+    }
+
+    // Reads the record_header and then the cards, and sizes the buffer for
+    // the records that follow.
+    bool receive_header(agent &a)
+    {
+        if (a.received < sizeof(record_header)) {
+            return true;
+        }
+
+        auto &h = a.header;
+        std::memcpy(&h, a.buffer.data(), sizeof(h));
+        if (std::memcmp(h.magic, record_magic, sizeof(record_magic)) != 0 ||
+            h.version != record_version || h.row_count != info::row_count ||
+            h.card_count == 0 || h.card_count > max_cards ||
+            h.record_size != record_size(h.card_count, h.oversampled)) {
+            return false;
+        }
+
+        auto size = sizeof(h) + h.card_count * sizeof(record_card);
+        if (a.buffer.size() < size) {
+            a.buffer.resize(size);
+        }
+        if (a.received < size) {
+            return true;
+        }
+
+        if (a.names.size() != h.card_count) {
+            m_layout_changed = true;
+            ++m_generation;
+        }
+        a.names.resize(h.card_count);
+        a.limits.resize(h.card_count);
+        a.samples.assign(h.card_count, sample{});
+        a.derived.assign(h.card_count, derived_values{});
+        a.rates = rate_stage(h.card_count);
+        for (size_t i = 0; i < h.card_count; ++i) {
+            record_card card;
+            std::memcpy(&card, a.buffer.data() + sizeof(h) + i * sizeof(card), sizeof(card));
+            card.name[sizeof(card.name) - 1] = '\0';
+            a.names[i] = card.name;
+            a.limits[i] = card.limits;
+        }
+
+        // Room for a few records, of which only the last is kept once its
+        // derived values are taken into account.
+        a.buffer.resize(4 * h.record_size);
+        a.received = 0;
+        a.connected = true;
+        a.status = "";
+        return true;
+    }
+
+    bool receive_records(agent &a)
+    {
+        auto size = a.header.record_size;
+        auto complete = a.received / size;
+        if (complete == 0) {
+            return true;
+        }
+
+        const auto *record = a.buffer.data();
+        for (size_t r = 0; r < complete; ++r, record += size) {
+            std::memcpy(a.samples.data(), record, a.samples.size() * sizeof(sample));
+            for (size_t i = 0; i < a.samples.size(); ++i) {
+                const auto &s = a.samples[i];
+                a.rates.update(i, s, static_cast<std::int64_t>(s.time) * 1000000, a.derived[i]);
+            }
+        }
+        record -= size;
+        std::memcpy(a.limits.data(), record + a.samples.size() * sizeof(sample),
+                    a.limits.size() * sizeof(struct limits));
+        a.received -= complete * size;
+        std::memmove(a.buffer.data(), record + size, a.received);
+        m_updates += complete;
+        return true;
+    }
+
+    event_loop &m_loop;
+    std::vector<agent> m_agents;
+    std::vector<gpu> m_gpus;
+    bool m_layout_changed = false;
+    std::uint64_t m_generation = 0;
+    std::uint64_t m_updates = 0;
+};
+
+// The last window values of a series and a histogram of them, for cheap
+// percentiles of e.g. latencies. Buckets are a quarter of a power of two wide,
+// so a percentile is at most 25% above the true value.
+class sliding_histogram {
+public:
+    void add(std::uint64_t value)
+    {
+        if (m_size == window) {
+            --m_counts[bucket(m_values[m_head])];
+        } else {
+            ++m_size;
+        }
+        m_values[m_head] = value;
+        ++m_counts[bucket(value)];
+        m_head = (m_head + 1) % window;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    // The upper bound of the bucket holding the q quantile, 0 if empty.
+    std::uint64_t percentile(double q) const
+    {
+        auto target = static_cast<size_t>(std::ceil(q * static_cast<double>(m_size)));
+        size_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i) {
+            seen += m_counts[i];
+            if (seen >= std::max(target, size_t{1})) {
+                return upper_bound(i);
+            }
+        }
+        return 0;
+    }
+
+private:
+    static constexpr size_t window = 256;
+    static constexpr size_t bucket_count = 256;
+
+    static size_t bucket(std::uint64_t value)
+    {
+        if (value < 4) {
+            return static_cast<size_t>(value);
+        }
+        auto e = static_cast<size_t>(63 - __builtin_clzll(value));
+        return 4 * (e - 1) + ((value >> (e - 2)) & 3);
+    }
+
+    static std::uint64_t upper_bound(size_t index)
+    {
+        if (index < 4) {
+            return index;
+        }
+        auto e = index / 4 + 1;
+        auto lower = (4 + index % 4) << (e - 2);
+        return lower + (std::uint64_t{1} << (e - 2)) - 1;
+    }
+
+    std::array<std::uint64_t, window> m_values = {};
+    std::array<std::uint16_t, bucket_count> m_counts = {};
+    size_t m_head = 0;
+    size_t m_size = 0;
+};
+
+// What gpumon itself costs per update: how long sampling and rendering or
+// writing took, how many bytes were written and how many system calls were
+// made to sample.
+struct self_stats {
+    sliding_histogram sample_ns;
+    sliding_histogram render_ns;
+    sliding_histogram bytes;
+    sliding_histogram syscalls;
+    sysfs_file statm{"/proc/self/statm"};
+    sysfs_file io{"/proc/self/io"};
+
+    // The bytes all threads of gpumon passed to write() so far, e.g. to the
+    // terminal.
+    std::uint64_t written() const
+    {
+        char buf[512];
+        auto n = io.read_raw(buf, sizeof(buf));
+        std::string_view text(buf, static_cast<size_t>(std::max<ssize_t>(n, 0)));
+        auto pos = text.find("wchar:");
+        std::uint64_t bytes = 0;
+        if (pos != std::string_view::npos) {
+            pos = text.find_first_of("0123456789", pos);
+            if (pos != std::string_view::npos) {
+                std::from_chars(text.data() + pos, text.data() + text.size(), bytes);
+            }
+        }
+        return bytes;
+    }
+
+    std::uint64_t rss() const
+    {
+        char buf[128];
+        std::uint64_t pages = 0;
+        if (statm.read(buf, sizeof(buf)) > 0) {
+            auto *space = std::strchr(buf, ' ');
+            if (space) {
+                std::from_chars(space + 1, buf + std::strlen(buf), pages);
+            }
+        }
+        return pages * static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    // Formats a one line summary of the percentiles into buf.
+    std::string_view format(char *buf, size_t size) const
+    {
+        char sample_p50[16], sample_p99[16], render_p50[16], render_p99[16];
+        auto n = std::snprintf(buf, size,
+            "sample p50 %s p99 %s  render p50 %s p99 %s  %llu B/update  %llu syscalls/update  RSS %.1f MiB",
+            format_duration(sample_p50, sample_ns.percentile(0.5)),
+            format_duration(sample_p99, sample_ns.percentile(0.99)),
+            format_duration(render_p50, render_ns.percentile(0.5)),
+            format_duration(render_p99, render_ns.percentile(0.99)),
+            static_cast<unsigned long long>(bytes.percentile(0.5)),
+            static_cast<unsigned long long>(syscalls.percentile(0.5)),
+            static_cast<double>(rss()) / (1 << 20));
+        return {buf, std::min(static_cast<size_t>(std::max(n, 0)), size - 1)};
+    }
+
+    static const char *format_duration(char (&buf)[16], std::uint64_t ns)
+    {
+        if (ns < 1000000) {
+            std::snprintf(buf, sizeof(buf), "%lluus", static_cast<unsigned long long>(ns / 1000));
+        } else {
+            std::snprintf(buf, sizeof(buf), "%.1fms", static_cast<double>(ns) / 1e6);
+        }
+        return buf;
+    }
+};
+
+bool write_file(const std::filesystem::path &path, std::string_view contents)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write_all(fd, contents.data(), contents.size());
+    ::close(fd);
+    return ok;
+}
+
+// How often the values of fake cards change.
+const std::int64_t fake_period = 100000000ll;
+
+// A directory under /tmp that is removed with everything in it on
+// destruction.
+class temp_dir {
+public:
+    temp_dir()
+    {
+        char path[] = "/tmp/gpumon-XXXXXX";
+        if (mkdtemp(path)) {
+            m_path = std::string(path) + '/';
+        }
+    }
+
+    temp_dir(const temp_dir &) = delete;
+    temp_dir &operator=(const temp_dir &) = delete;
+
+    ~temp_dir()
+    {
+        if (!m_path.empty()) {
+            std::error_code ec;
+            std::filesystem::remove_all(m_path, ec);
+        }
+    }
+
+    // Empty if the directory could not be created.
+    const std::string &path() const
+    {
+        return m_path;
+    }
+
+private:
+    std::string m_path;
+};
+
+// Whether fake cards change the file of the row. Decimals such as the link
+// speed are written once.
+bool is_fake_row(unsigned row)
+{
+    return info::metrics[row].format != info::parse::decimal;
+}
+
+// The DPM levels of fake cards in MHz.
+const unsigned fake_sclk_levels[] = {500, 1500, 2000};
+const unsigned fake_mclk_levels[] = {875, 1000};
+
+// Formats value as the contents of the file of the row into buf, which must
+// hold at least 128 bytes, and returns their size.
+size_t format_fake(unsigned row, std::uint64_t value, char *buf)
+{
+    char *end = buf + 128;
+    char *out = buf;
+    auto number = [&](std::uint64_t n) {
+        out = std::to_chars(out, end, n).ptr;
+    };
+    auto text = [&](std::string_view str) {
+        out = std::copy(str.begin(), str.end(), out);
+    };
+
+    switch (info::metrics[row].format) {
+    case info::parse::counts:
+        // Packets received and sent with a payload of 256 bytes.
+        number(value / 512);
+        text(" ");
+        number(value / 512);
+        text(" 256\n");
+        break;
+    case info::parse::levels: {
+        bool sclk = row == info::sclk_level;
+        auto *levels = sclk ? fake_sclk_levels : fake_mclk_levels;
+        auto count = sclk ? std::size(fake_sclk_levels) : std::size(fake_mclk_levels);
+        for (size_t level = 0; level < count; ++level) {
+            number(level);
+            text(": ");
+            number(levels[level]);
+            text(level == value ? "Mhz *\n" : "Mhz\n");
+        }
+        break;
+    }
+    default:
+        number(value);
+        text("\n");
+        break;
+    }
+    return static_cast<size_t>(out - buf);
+}
+
+// Plausible values of fake card index at t seconds: the load of every card
+// follows a slow wave of its own and the other sensors follow the load.
+std::array<std::uint64_t, info::row_count> fake_values(unsigned index, double t)
+{
+    auto load = std::clamp(0.5 + 0.45 * std::sin(t * 0.5 + index * 0.7), 0.0, 1.0);
+
+    std::array<std::uint64_t, info::row_count> values = {};
+    values[info::busy] = static_cast<std::uint64_t>(load * 100.0);
+    values[info::vram] = (1ull << 30) + static_cast<std::uint64_t>(load * (4ull << 30));
+    values[info::gtt] = (100ull << 20) + static_cast<std::uint64_t>(load * (100ull << 20));
+    values[info::cpu_vis] = (25ull << 20) + static_cast<std::uint64_t>(load * (25ull << 20));
+    values[info::power] = 20000000 + static_cast<std::uint64_t>(load * 180000000.0);
+    values[info::temperature] = 40000 + static_cast<std::uint64_t>(load * 40000.0);
+    values[info::fan] = 800 + static_cast<std::uint64_t>(load * 2000.0);
+    values[info::voltage] = 750 + static_cast<std::uint64_t>(load * 400.0);
+    values[info::gfx_clock] = 500000000 + static_cast<std::uint64_t>(load * 1500.0) * 1000000;
+    values[info::mem_clock] = load > 0.5 ? 1000000000 : 875000000;
+    values[info::link_speed] = 8000;
+    values[info::link_width] = 16;
+    values[info::pcie_bw] = static_cast<std::uint64_t>(load * 2e9);
+    values[info::sclk_level] = load < 0.2 ? 0 : load < 0.7 ? 1 : 2;
+    values[info::mclk_level] = load > 0.5 ? 1 : 0;
+
+    // The power draw integrated from 0 to t.
+    auto phase = index * 0.7;
+    auto joules = 20.0 * t + 180.0 * (0.5 * t - 0.9 * (std::cos(t * 0.5 + phase) - std::cos(phase)));
+    values[info::energy] = static_cast<std::uint64_t>(joules * 1e6);
+    return values;
+}
+
+// A v1.1 gpu_metrics table, encoded with the same field descriptions gpumon
+// decodes it with.
+std::string fake_metrics(const std::array<std::uint64_t, info::row_count> &values)
+{
+    std::string table(96, '\0');
+    std::uint16_t size = static_cast<std::uint16_t>(table.size());
+    std::memcpy(table.data(), &size, sizeof(size));
+    table[2] = 1;
+    table[3] = 1;
+    for (const auto &field : metrics_fields) {
+        if (field.format != 1 || field.min_content > 1 || field.max_content < 1) {
+            continue;
+        }
+        auto raw = static_cast<std::uint32_t>(values[field.row] / field.scale);
+        std::memcpy(table.data() + field.offset, &raw, field.size);
+    }
+    return table;
+}
+
+// Creates cards fake amdgpu cards under root, laid out like /sys/class/drm
+// and with a gpu_metrics table, so that gpumon can be exercised without a GPU.
+bool create_fake_tree(const std::filesystem::path &root, unsigned cards)
+{
+    namespace fs = std::filesystem;
+
+    std::error_code ec;
+    fs::create_directories(root / "drivers" / "amdgpu", ec);
+
+    for (unsigned i = 0; i < cards && !ec; ++i) {
+        auto dev = root / ("card" + std::to_string(i)) / "device";
+        auto hwmon = dev / "hwmon" / "hwmon0";
+        fs::create_directories(hwmon, ec);
+        fs::create_directory_symlink("../../drivers/amdgpu", dev / "driver", ec);
+        if (ec) {
+            break;
+        }
+
+        auto values = fake_values(i, 0.0);
+        for (unsigned row = 0; row < info::row_count; ++row) {
+            const auto &metric = info::metrics[row];
+            char buf[128];
+            if (is_fake_row(row) &&
+                !write_file((metric.hwmon ? hwmon : dev) / metric.file,
+                            std::string_view(buf, format_fake(row, values[row], buf)))) {
+                return false;
+            }
+        }
+
+        const std::pair<fs::path, std::string_view> files[] = {
+            {dev / "mem_info_vram_total", "8589934592"},
+            {dev / "mem_info_gtt_total", "4294967296"},
+            {dev / "mem_info_vis_vram_total", "268435456"},
+            {dev / "current_link_speed", "8.0 GT/s PCIe"},
+            {hwmon / "name", "amdgpu"},
+            {hwmon / "power1_cap_min", "0"},
+            {hwmon / "power1_cap_max", "220000000"},
+            {hwmon / "temp1_crit", "100000"},
+            {hwmon / "fan1_min", "0"},
+            {hwmon / "fan1_max", "3300"},
+        };
+        for (const auto &[path, contents] : files) {
+            if (!write_file(path, std::string(contents) + '\n')) {
+                return false;
+            }
+        }
+
+        if (!write_file(dev / "gpu_metrics", fake_metrics(values))) {
+            return false;
+        }
+    }
+
+    return !ec;
+}
+
+// Rewrites the sensor files of a tree made by create_fake_tree() every
+// period on a thread of its own, so that the values change over time. Files
+// are overwritten in place rather than replaced, as gpumon keeps them open.
+class fake_generator {
+public:
+    fake_generator(const std::string &root, unsigned cards, std::int64_t period)
+        : m_period(period)
+        , m_files(cards)
+    {
+        for (unsigned i = 0; i < cards; ++i) {
+            auto dev = root + "card" + std::to_string(i) + "/device/";
+            for (unsigned row = 0; row < info::row_count; ++row) {
+                m_files[i][row] = -1;
+                const auto &metric = info::metrics[row];
+                if (is_fake_row(row)) {
+                    auto path = dev + (metric.hwmon ? "hwmon/hwmon0/" : "") + std::string(metric.file);
+                    m_files[i][row] = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+                }
+            }
+            m_files[i][info::row_count] = ::open((dev + "gpu_metrics").c_str(), O_WRONLY | O_CLOEXEC);
+        }
+    }
+
+    fake_generator(const fake_generator &) = delete;
+    fake_generator &operator=(const fake_generator &) = delete;
+
+    ~fake_generator()
+    {
+        stop();
+        for (const auto &files : m_files) {
+            for (int fd : files) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+        }
+    }
+
+    void start()
+    {
+        m_thread = std::thread([this]{ run(); });
+    }
+
+    void stop()
+    {
+        if (m_thread.joinable()) {
+            m_control.notify();
+            m_thread.join();
+        }
+    }
+
+private:
+    void run()
+    {
+        // Signals are left to the threads that handle them.
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        event_loop loop;
+        timer_fd timer;
+        timer.set_period(std::max(m_period, min_interval));
+        auto start = monotonic_ns();
+
+        loop.add(timer.fd(), EPOLLIN, [&](std::uint32_t){
+            if (timer.read() > 0) {
+                write_all_cards(static_cast<double>(monotonic_ns() - start) / 1e9);
+            }
+        });
+        loop.add(m_control.fd(), EPOLLIN, [&](std::uint32_t){
+            loop.stop();
+        });
+
+        loop.run();
+    }
+
+    void write_all_cards(double t)
+    {
+        char buf[128];
+        for (size_t i = 0; i < m_files.size(); ++i) {
+            auto values = fake_values(static_cast<unsigned>(i), t);
+            for (unsigned row = 0; row < info::row_count; ++row) {
+                if (m_files[i][row] < 0) {
+                    continue;
+                }
+                overwrite(m_files[i][row], buf, format_fake(row, values[row], buf));
+            }
+
+            auto table = fake_metrics(values);
+            overwrite(m_files[i][info::row_count], table.data(), table.size());
+        }
+    }
+
+    // A reader that sees the old, longer contents before the truncation still
+    // stops at the first newline.
+    static void overwrite(int fd, const char *data, size_t size)
+    {
+        if (fd >= 0 && pwrite(fd, data, size, 0) == static_cast<ssize_t>(size)) {
+            ftruncate(fd, static_cast<off_t>(size));
+        }
+    }
+
+    std::int64_t m_period;
+    // The sensor files of every card by row, followed by its gpu_metrics.
+    std::vector<std::array<int, info::row_count + 1>> m_files;
+    event_fd m_control;
+    std::thread m_thread;
+};
+
+// Times sampling every card under root with each backend, directly on the
+// calling thread, and prints the cost of sampling one card once.
+int run_bench(const std::string &root, unsigned iterations)
+{
+    struct variant {
+        std::string_view name;
+        backend source;
+        bool reopen;
+    };
+
+    const variant variants[] = {
+        {"reopen", backend::sysfs, true},
+        {"sysfs", backend::sysfs, false},
+        {"gpu_metrics", backend::gpu_metrics, false},
+#ifdef GPUMON_HAVE_LIBDRM
+        {"ioctl", backend::ioctl, false},
+#endif
+    };
+
+    auto cards = find_cards(root);
+    if (cards.empty() || iterations == 0) {
+        std::cout << "No amdgpu devices found. Exiting." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::printf("%zu cards, %u iterations\n", cards.size(), iterations);
+    std::printf("%-12s %12s %16s %14s\n", "backend", "ns/sample", "syscalls/sample", "allocs/sample");
+
+    for (const auto &v : variants) {
+        sysfs_file::reopen_each_read = v.reopen;
+
+        std::vector<device> devices;
+        for (const auto &card : cards) {
+            devices.emplace_back(card, root + card + "/device/", v.source);
+        }
+
+        // Cards that cannot use the backend read sysfs instead, which would
+        // pass off sysfs timings as the backend's.
+        auto fallbacks = static_cast<size_t>(std::count_if(devices.cbegin(), devices.cend(), [&](const auto &dev){
+            return (v.source == backend::gpu_metrics && !dev.uses_metrics()) ||
+                (v.source == backend::ioctl && !dev.uses_ioctl());
+        }));
+        if (fallbacks == devices.size()) {
+            std::printf("%-12.*s not available on these cards\n", static_cast<int>(v.name.size()), v.name.data());
+            continue;
+        }
+
+        // Rows that are off by default are left out, pcie_bw alone would
+        // take a second per sample.
+        auto rows = row_set::defaults();
+        for (unsigned row = 0; row < info::row_count; ++row) {
+            rows.set(row, rows.test(row) && std::any_of(devices.cbegin(), devices.cend(), [row](const auto &dev){
+                return dev.supports(row);
+            }));
+        }
+
+        std::vector<sample> out(devices.size());
+        for (unsigned i = 0; i < 16; ++i) {
+            for (size_t d = 0; d < devices.size(); ++d) {
+                devices[d].sample(out[d], rows);
+            }
+        }
+
+        auto syscalls = counters::syscalls.load();
+        auto allocations = counters::allocations.load();
+        auto start = monotonic_ns();
+        for (unsigned i = 0; i < iterations; ++i) {
+            for (size_t d = 0; d < devices.size(); ++d) {
+                devices[d].sample(out[d], rows);
+            }
+        }
+        auto elapsed = monotonic_ns() - start;
+
+        auto samples = static_cast<double>(iterations) * static_cast<double>(devices.size());
+        char allocs[32] = "-";
+        if (counters::count_allocations) {
+            std::snprintf(allocs, sizeof(allocs), "%.2f",
+                          static_cast<double>(counters::allocations.load() - allocations) / samples);
+        }
+        std::printf("%-12.*s %12.0f %16.2f %14s\n", static_cast<int>(v.name.size()), v.name.data(),
+                    static_cast<double>(elapsed) / samples,
+                    static_cast<double>(counters::syscalls.load() - syscalls) / samples, allocs);
+        if (fallbacks > 0) {
+            std::printf("%-12s (%zu of %zu cards read sysfs instead)\n", "", fallbacks, devices.size());
+        }
+    }
+
+    sysfs_file::reopen_each_read = false;
+    return EXIT_SUCCESS;
+}
+
+// The rows that --disable and --enable take, from the table so that new rows
+// are listed too, wrapped like the rest of the help text.
+std::string valid_rows_text()
+{
+    const size_t indent = 22;
+    const size_t width = 72;
+
+    std::string out;
+    std::string line(indent, ' ');
+    line += "separated list ROWS. Valid options are";
+    auto add = [&](std::string_view word){
+        if (line.size() + 1 + word.size() > width) {
+            out.append(line).append(1, '\n');
+            line.assign(indent, ' ');
+        } else {
+            line.push_back(' ');
+        }
+        line.append(word);
+    };
+    for (unsigned row = 0; row < info::row_count; ++row) {
+        std::string word(info::metrics[row].name);
+        if (row + 2 == info::row_count) {
+            add(word);
+            add("and");
+            continue;
+        }
+        word.append(row + 1 == info::row_count ? "." : ",");
+        add(word);
+    }
+    for (auto word : {"Other", "values", "are", "silently", "ignored."}) {
+        add(word);
+    }
+    return out.append(line).append(1, '\n');
+}
+
+void print_help(std::string_view progName)
+{
+    std::cout << "Usage: " << progName << " [options]\n"
+        "Released under the GNU GPLv3\n\n"
+        "  -n, --no-color      disable colors\n"
+        "  -u, --update=N      set automatic updates to N seconds (default 2).\n"
+        "                      N may be fractional, e.g. 0.1\n"
+        "      --interval-ms=N set automatic updates to N milliseconds\n"
+        "  -r, --redraw=N      redraw the screen every N seconds instead of\n"
+        "                      whenever new samples arrive\n"
+        "  -s, --oversample=HZ also read busy, power and clocks HZ times per\n"
+        "                      second and show their mean, range and p95 over\n"
+        "                      each update\n"
+        "      --adaptive[=N]  while the GPUs are idle, double the update\n"
+        "                      interval up to N seconds (default 30) and pause\n"
+        "                      oversampling. Activity or a key press restores\n"
+        "                      it\n"
+        "  -h, --help          display this message\n"
+        "  -d, --disable=ROWS  disable each row corresponding to the comma\n"
+        << valid_rows_text() <<
+        "  -e, --enable=ROWS   enable rows like --disable disables them. The\n"
+        "                      rows pcie_bw (PCIe bandwidth, which takes the\n"
+        "                      driver a second to measure), energy (used since\n"
+        "                      start), sclk_level and mclk_level (the time\n"
+        "                      spent at each DPM level) are off by default\n"
+        "  -f, --format=FMT    write samples to stdout as csv or jsonl instead\n"
+        "                      of starting the interactive display\n"
+        "  -o, --output=FILE   write samples to FILE instead of stdout. Implies\n"
+        "                      --format=csv unless another format is given\n"
+        "      --once[=N]      write one sample of every card as csv, or in\n"
+        "                      the format given, and exit. With N, sample\n"
+        "                      twice N seconds apart so that energy and DPM\n"
+        "                      levels cover that time\n"
+        "      --serve=ADDR:PORT\n"
+        "                      serve OpenMetrics for Prometheus on ADDR:PORT\n"
+        "                      instead of starting the interactive display.\n"
+        "                      ADDR may be empty to listen on all addresses\n"
+        "      --record=FILE   record samples to FILE in a compact binary\n"
+        "                      format instead of starting the interactive\n"
+        "                      display\n"
+        "      --replay=FILE   play back a recording made with --record\n"
+        "      --agent[=ADDR:PORT]\n"
+        "                      stream samples to collectors connecting to\n"
+        "                      ADDR:PORT (default :7411) instead of starting\n"
+        "                      the interactive display\n"
+        "      --shm[=NAME]    publish the newest samples in the POSIX shared\n"
+        "                      memory segment NAME (default /gpumon) for\n"
+        "                      readers using gpumon_shm.hpp instead of\n"
+        "                      starting the interactive display\n"
+        "      --collect=HOSTS show the cards of every agent in the comma\n"
+        "                      separated list HOSTS of HOST[:PORT] as one\n"
+        "                      table, or of those listed in FILE for @FILE\n"
+        "      --backend=NAME  read sensors with NAME: gpu_metrics reads them\n"
+        "                      from the binary gpu_metrics table in one go,\n"
+        "                      sysfs from one file each. auto (the default)\n"
+        "                      uses gpu_metrics where the kernel provides it.\n"
+        "                      ioctl queries the driver through libdrm, if\n"
+        "                      gpumon was built with it\n"
+        "      --alert=RULE    report when RULE, like temperature>90%,for=5,\n"
+        "                      holds on a card and when it clears again. RULE\n"
+        "                      is ROW>VALUE or ROW<VALUE in the units shown or\n"
+        "                      as % of the bar, then optionally ,for=SECONDS\n"
+        "                      it must hold, ,clear=VALUE to clear at and\n"
+        "                      ,when=ROW>VALUE that must hold too. May be\n"
+        "                      given more than once. Without the interactive\n"
+        "                      display, events are written to stderr\n"
+        "      --alert-hook=CMD\n"
+        "                      run CMD with sh on every alert event, with\n"
+        "                      GPUMON_ALERT, GPUMON_CARD, GPUMON_RULE and\n"
+        "                      GPUMON_VALUE set\n"
+        "      --view=VIEWS    start the interactive display with the comma\n"
+        "                      separated VIEWS: panels or table, and graphs,\n"
+        "                      processes and stats\n"
+        "      --config=FILE   read options from FILE, one key = value line\n"
+        "                      per long option, before those given here. By\n"
+        "                      default ~/.config/gpumon/config is read if it\n"
+        "                      exists\n"
+        "      --self-stats    print what gpumon itself cost per update to\n"
+        "                      stderr on exit when not interactive\n"
+        "      --sysfs-root=DIR\n"
+        "                      look for cards in DIR instead of /sys/class/drm\n"
+        "      --fake=N        monitor N generated fake cards whose values\n"
+        "                      change over time instead of the real ones\n"
+        "      --bench[=N]     time N samples of every card with each backend\n"
+        "                      (default 10000) and print the cost per sample\n"
+        "      --bench-fake=CARDS\n"
+        "                      benchmark a generated tree of CARDS fake cards\n"
+        "                      instead of the real ones, e.g. in CI\n";
+}
+
+// Sets up the terminal for the interactive display.
+void start_screen()
+{
+    setlocale(LC_ALL, "");
+    use_unicode = std::string_view(nl_langinfo(CODESET)) == "UTF-8";
+
+    initscr();
+
+    nodelay(stdscr, true);
+    noecho();
+    curs_set(0);
+    keypad(stdscr, true);
+    clear();
+
+    color::use_color &= has_colors();
+
+    if (color::use_color) {
+        start_color();
+        use_default_colors();
+        init_pair(static_cast<int>(color::type::label), COLOR_CYAN, -1);
+        init_pair(static_cast<int>(color::type::value), COLOR_BLACK, -1);
+        init_pair(static_cast<int>(color::type::ok), COLOR_GREEN, -1);
+        init_pair(static_cast<int>(color::type::warn), COLOR_YELLOW, -1);
+        init_pair(static_cast<int>(color::type::bad), COLOR_RED, -1);
+    }
+}
+
+void handle_winch()
+{
+    winsize w;
+    ioctl(0, TIOCGWINSZ, &w);
+    resizeterm(w.ws_row, w.ws_col);
+}
+
+// Takes one sample of every card, back to back, or a second one gap
+// nanoseconds later if gap is positive, so that energy and DPM residency cover
+// the gap. The last sample is written to fd in the given format. Nothing but
+// the devices is set up: no sampler thread, event loop or terminal.
+int run_once(const std::vector<device> &devices, const row_set &enabled_rows, output_format format, int fd,
+             std::int64_t gap)
+{
+    frame f;
+    f.samples.resize(devices.size());
+    f.aggregates.resize(devices.size());
+    f.derived.resize(devices.size());
+    for (const auto &dev : devices) {
+        f.limits.push_back(dev.limits());
+    }
+
+    rate_stage rates(devices.size());
+    auto take = [&]{
+        for (size_t i = 0; i < devices.size(); ++i) {
+            devices[i].sample(f.samples[i], enabled_rows);
+            rates.update(i, f.samples[i], monotonic_ns(), f.derived[i]);
+        }
+    };
+
+    take();
+    if (gap > 0) {
+        timespec ts = {static_cast<time_t>(gap / 1000000000), static_cast<long>(gap % 1000000000)};
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+        take();
+    }
+
+    stream_writer writer(fd, format, devices, enabled_rows, false);
+    if (!writer.write_header() || !writer.write(f)) {
+        perror("write");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Streams samples in the given format to fd unless the format is none,
+// records them to record_fd unless it is negative and serves them as
+// OpenMetrics on serve_address and as a recording to collectors on
+// agent_address unless they are null. The sampler publishes them to shared
+// memory itself. A negative interval publishes the first sample only. With
+// report_stats, what gpumon itself cost is printed to stderr on exit. Alert
+// events are written to stderr.
+int run_headless(const std::vector<device> &devices, const row_set &enabled_rows,
+                 const sampler_config &config, output_format format, int fd, int record_fd,
+                 const char *serve_address, const char *agent_address, bool report_stats)
+{
+    signal_fd signals({SIGINT, SIGTERM});
+
+    auto alerting = config;
+    alerting.alert_fd = STDERR_FILENO;
+    sampler smp(devices, enabled_rows, alerting);
+    std::optional<stream_writer> writer;
+    if (format != output_format::none) {
+        writer.emplace(fd, format, devices, enabled_rows, smp.oversampling());
+        if (!writer->write_header()) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::optional<recorder> rec;
+    if (record_fd >= 0) {
+        rec.emplace(record_fd, devices, enabled_rows, config, smp.oversampling());
+        if (!rec->write_header()) {
+            perror("record");
+            return EXIT_FAILURE;
+        }
+    }
+
+    self_stats stats;
+    size_t updates = 0;
+    auto report = [&]{
+        if (report_stats) {
+            char line[256];
+            std::cerr << "gpumon: " << updates << " updates, " << stats.format(line, sizeof(line)) << '\n';
+        }
+    };
+
+    event_loop loop;
+    metrics_server server(loop, devices, enabled_rows);
+    if (serve_address && !server.listen(serve_address)) {
+        return EXIT_FAILURE;
+    }
+    agent_server agent(loop, devices, enabled_rows, config, smp.oversampling());
+    if (agent_address && !agent.listen(agent_address)) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    auto publish = [&]{
+        const auto &current = smp.current();
+        auto start = monotonic_ns();
+        auto bytes = report_stats ? stats.written() : 0;
+        stats.sample_ns.add(static_cast<std::uint64_t>(current.sample_ns));
+        stats.syscalls.add(current.sample_syscalls);
+        ++updates;
+
+        if (serve_address) {
+            server.update(current);
+        }
+        if (agent_address) {
+            agent.update(current);
+        }
+        if (writer && !writer->write(current)) {
+            perror("write");
+            ret = EXIT_FAILURE;
+            loop.stop();
+        }
+        if (rec && !rec->write(current)) {
+            perror("record");
+            ret = EXIT_FAILURE;
+            loop.stop();
+        }
+
+        stats.render_ns.add(static_cast<std::uint64_t>(monotonic_ns() - start));
+        if (report_stats) {
+            stats.bytes.add(stats.written() - bytes);
+        }
+    };
+
+    loop.add(smp.fd(), EPOLLIN, [&](std::uint32_t){
+        smp.drain();
+        if (smp.update()) {
+            publish();
+        }
+    });
+    loop.add(signals.fd(), EPOLLIN, [&](std::uint32_t){
+        while (signals.read() > 0) {
+            loop.stop();
+        }
+    });
+
+    smp.start();
+    smp.drain();
+    publish();
+    loop.run();
+    report();
+
+    return ret;
+}
+
+// How the interactive display starts out, from --view.
+struct view_options {
+    std::optional<bool> table; // by default, whether the panels do not fit
+    bool graphs = false;
+    bool processes = false;
+    bool stats = false;
+};
+
+// Parses the comma separated list of panels, table, graphs, processes and
+// stats given to --view.
+bool parse_view(std::string_view list, view_options &view)
+{
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        auto end = std::min(list.find(',', pos), list.size());
+        auto item = list.substr(pos, end - pos);
+        if (item == "panels" || item == "table") {
+            view.table = item == "table";
+        } else if (item == "graphs") {
+            view.graphs = true;
+        } else if (item == "processes") {
+            view.processes = true;
+        } else if (item == "stats") {
+            view.stats = true;
+        } else {
+            return false;
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+// Lists the rows that can be shown in a box at the top left, each with the
+// key that shows or hides it.
+void draw_row_menu(const row_set &rows, const row_set &available)
+{
+    const int width = 34;
+    int line = vpad;
+    auto print_line = [&](std::string_view text){
+        char buf[width + 1];
+        std::snprintf(buf, sizeof(buf), " %-*.*s", width - 1, static_cast<int>(text.size()), text.data());
+        move(line++, hpad);
+        print_string(color::type::label, {buf, std::min<size_t>(width, static_cast<size_t>(std::max(COLS - hpad, 0)))},
+                     A_REVERSE);
+    };
+
+    print_line("Rows, any other key closes");
+    for (unsigned row = 0; row < info::row_count && line < LINES; ++row) {
+        if (!available.test(row)) {
+            continue;
+        }
+        row_text text;
+        char key[] = {static_cast<char>('a' + row), '\0'};
+        text << key << "  [" << (rows.test(row) ? "x" : " ") << "] " << info::metrics[row].name;
+        print_line(text.view());
+    }
+}
+
+// Shows the frames of src, which is either a sampler or a player. A negative
+// interval only samples on key presses. Every key press that does not quit or
+// control the player or the table samples immediately. The screen is redrawn
+// whenever new samples arrive, or every redraw nanoseconds if that is not
+// negative. t switches between a panel per card and a table of all cards, o
+// opens a menu to show or hide rows, and + and - halve or double the
+// interval. Hidden rows are no longer sampled.
+template <typename Source>
+int run_tui(const std::vector<device> &devices, const row_set &enabled_rows, Source &smp,
+            std::int64_t interval, std::int64_t redraw, const view_options &view)
+{
+    constexpr bool replay = std::is_same_v<Source, player>;
+
+    signal_fd signals({SIGINT, SIGTERM, SIGWINCH});
+
+    std::vector<drawn_rows> drawn(devices.size());
+
+    // Any row that a card supports, and that was recorded in a replay, can be
+    // shown.
+    auto rows = enabled_rows;
+    row_set available;
+    for (unsigned row = 0; row < info::row_count; ++row) {
+        bool supported = std::any_of(devices.begin(), devices.end(),
+                                     [row](const device &dev){ return dev.supports(row); });
+        if constexpr (replay) {
+            supported = supported && smp.recorded(row);
+        }
+        available.set(row, supported || rows.test(row));
+    }
 
-        auto key = getch();
-        if (key == 'q' || key == end_of_transmission || key == escape) {
-            break;
+    start_screen();
+
+    // The panels of many cards do not fit, so those start out as a table.
+    gpu_table table(rows);
+    std::vector<std::string> names;
+    for (const auto &dev : devices) {
+        names.push_back(dev.name());
+    }
+    table.set_cards(std::move(names));
+    bool show_table = view.table.value_or(panels_end(rows, devices.size()) + vpad > LINES);
+
+    if (!show_table) {
+        draw_labels(devices, rows);
+    }
+
+    event_loop loop;
+    timer_fd timer;
+    history hist(devices.size(), history_capacity(interval));
+    bool show_graphs = view.graphs;
+    bool show_processes = view.processes;
+    bool show_stats = view.stats;
+    bool show_menu = false;
+    self_stats stats;
+    int status_top = LINES;
+
+    // Shown for a few seconds after the interval changed.
+    std::array<char, 64> message;
+    size_t message_size = 0;
+    std::int64_t message_until = 0;
+
+    auto draw = [&]{
+        auto start = monotonic_ns();
+        auto bytes = show_stats ? stats.written() : 0;
+
+        if (smp.update()) {
+            if constexpr (replay) {
+                if (smp.jumped()) {
+                    hist.clear();
+                }
+            }
+            hist.push(smp.current());
+            stats.sample_ns.add(static_cast<std::uint64_t>(smp.current().sample_ns));
+            stats.syscalls.add(smp.current().sample_syscalls);
+        }
+        const auto &current = smp.current();
+        auto width = graph_width(show_graphs);
+
+        for (size_t i = 0; i < devices.size() && !show_table; ++i) {
+            int row = vpad-1 + static_cast<int>(i) * panel_height(rows, devices.size());
+            row += devices.size() > 1;
+            const auto *agg = smp.oversampling() ? &current.aggregates[i] : nullptr;
+            draw_values(row, rows, current.limits[i], current.samples[i], current.derived[i], agg,
+                        drawn[i], width);
+            if (show_graphs) {
+                draw_graphs(row, rows, hist, i, width);
+            }
+        }
+
+        // Status lines stack up from the bottom of the window.
+        int bottom = LINES;
+        if constexpr (replay) {
+            move(--bottom, hpad);
+            clrtoeol();
+            print_string(color::type::label, smp.status());
+        }
+        if (show_stats) {
+            char line[256];
+            move(--bottom, hpad);
+            clrtoeol();
+            auto text = stats.format(line, sizeof(line));
+            print_string(color::type::label, text.substr(0, static_cast<size_t>(std::max(COLS - hpad, 0))));
+        }
+        if (monotonic_ns() < message_until) {
+            move(--bottom, hpad);
+            clrtoeol();
+            print_string(color::type::label, std::string_view(message.data(), message_size));
+        }
+        if (!current.alerts.empty()) {
+            row_text text;
+            text << "alerts:";
+            for (const auto &alert : current.alerts) {
+                text << " " << devices[alert.card].name() << " " << alert.rule->text;
+            }
+            move(--bottom, hpad);
+            clrtoeol();
+            print_string(color::type::bad, text.view().substr(0, static_cast<size_t>(std::max(COLS - hpad, 0))),
+                         A_BOLD);
+        }
+        // Lines left over from status lines that are gone.
+        for (int line = status_top; line < bottom; ++line) {
+            move(line, 0);
+            clrtoeol();
+        }
+        status_top = bottom;
+
+        if (show_table) {
+            for (size_t i = 0; i < devices.size(); ++i) {
+                table.set(i, with_derived(current.samples[i], current.derived[i]), current.limits[i]);
+            }
+            int end = bottom;
+            if (show_processes) {
+                end = std::min(bottom / 2, vpad + static_cast<int>(devices.size()));
+            }
+            end = table.draw(vpad - 1, end);
+            if (show_processes) {
+                draw_processes(end + vpad, bottom, current.processes, devices);
+            }
+        } else if (show_processes) {
+            draw_processes(panels_end(rows, devices.size()) + vpad, bottom, current.processes, devices);
+        }
+
+        if (show_menu) {
+            draw_row_menu(rows, available);
+        }
+
+        refresh();
+
+        stats.render_ns.add(static_cast<std::uint64_t>(monotonic_ns() - start));
+        if (show_stats) {
+            stats.bytes.add(stats.written() - bytes);
         }
+    };
+
+    auto redraw_all = [&]{
+        clear();
+        if (!show_table) {
+            draw_labels(devices, rows);
+        }
+        std::fill(drawn.begin(), drawn.end(), drawn_rows{});
+        status_top = LINES;
+        draw();
+    };
+
+    // The last shown row cannot be hidden.
+    auto toggle_row = [&](unsigned row){
+        rows.set(row, !rows.test(row));
+        if (rows.empty()) {
+            rows.set(row, true);
+            return;
+        }
+        table.set_rows(rows);
+        if constexpr (!replay) {
+            smp.set_rows(rows);
+        }
+        redraw_all();
+    };
+
+    auto set_interval = [&](std::int64_t next){
+        interval = std::clamp(next, std::int64_t{10000000}, std::int64_t{3600000000000});
+        if constexpr (!replay) {
+            smp.set_interval(interval);
+        }
+        auto n = std::snprintf(message.data(), message.size(), "update interval %.3gs",
+                               static_cast<double>(interval) / 1e9);
+        message_size = std::min(static_cast<size_t>(std::max(n, 0)), message.size() - 1);
+        message_until = monotonic_ns() + 3000000000ll;
+    };
+
+    loop.add(smp.fd(), EPOLLIN, [&](std::uint32_t){
+        smp.drain();
+        if (redraw < 0) {
+            draw();
+        }
+    });
+
+    if (redraw >= 0) {
+        timer.set_period(std::max(redraw, min_interval));
+        loop.add(timer.fd(), EPOLLIN, [&](std::uint32_t){
+            if (timer.read() > 0) {
+                draw();
+            }
+        });
+    }
+
+    loop.add(STDIN_FILENO, EPOLLIN, [&](std::uint32_t){
+        bool pressed = false;
+        int key;
+        while ((key = getch()) != ERR) {
+            // The menu takes every key, and any that toggles no row closes it.
+            if (show_menu && key != KEY_RESIZE) {
+                auto row = static_cast<unsigned>(key - 'a');
+                if (key >= 'a' && row < info::row_count && available.test(row)) {
+                    toggle_row(row);
+                } else {
+                    show_menu = false;
+                    redraw_all();
+                }
+                continue;
+            }
+            if (key == 'q' || key == end_of_transmission || key == escape) {
+                loop.stop();
+                return;
+            }
+            if (key == 'o') {
+                show_menu = true;
+                draw();
+                continue;
+            }
+            if (key == 'g') {
+                show_graphs = !show_graphs;
+                redraw_all();
+                continue;
+            }
+            if (key == 't') {
+                show_table = !show_table;
+                redraw_all();
+                continue;
+            }
+            if constexpr (replay) {
+                if (smp.handle_key(key) || (show_table && table.handle_key(key))) {
+                    draw();
+                }
+            } else if (show_table && table.handle_key(key)) {
+                draw();
+            } else if (key == 's') {
+                show_stats = !show_stats;
+                redraw_all();
+            } else if (key == 'p') {
+                show_processes = !show_processes;
+                smp.scan_processes(show_processes);
+                smp.poke();
+                redraw_all();
+            } else if ((key == '+' || key == '-') && interval > 0) {
+                set_interval(key == '+' ? interval / 2 : interval * 2);
+                draw();
+            } else {
+                pressed |= key != KEY_RESIZE;
+            }
+        }
+        if constexpr (!replay) {
+            if (pressed) {
+                smp.poke();
+            }
+        }
+    });
+
+    loop.add(signals.fd(), EPOLLIN, [&](std::uint32_t){
+        int sig;
+        while ((sig = signals.read()) > 0) {
+            if (sig != SIGWINCH) {
+                loop.stop();
+                return;
+            }
+            handle_winch();
+            redraw_all();
+        }
+    });
+
+    if constexpr (!replay) {
+        smp.scan_processes(show_processes);
     }
+    smp.start();
+    draw();
+    loop.run();
 
+    smp.stop();
     endwin();
 
     return EXIT_SUCCESS;
 }
+
+// Rows disabled on the command line stay hidden, and rows that were not
+// recorded cannot be shown.
+int run_replay(const char *path, row_set enabled_rows, std::int64_t redraw, const view_options &view)
+{
+    player src;
+    if (!src.open(path)) {
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned row = 0; row < info::row_count; ++row) {
+        enabled_rows.set(row, enabled_rows.test(row) && src.recorded(row));
+    }
+    if (enabled_rows.empty()) {
+        std::cout << "All rows disabled. Exiting." << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    auto devices = src.devices();
+    return run_tui(devices, enabled_rows, src, src.interval(), redraw, view);
+}
+
+// Splits the comma separated list of agents given to --collect, or reads them
+// from FILE, separated by white space, if it is given as @FILE.
+std::vector<std::string> collect_targets(std::string_view list)
+{
+    std::vector<std::string> targets;
+    std::string contents;
+    if (!list.empty() && list.front() == '@') {
+        std::ifstream in(std::string(list.substr(1)));
+        if (!in) {
+            std::cerr << list.substr(1) << ": " << std::strerror(errno) << '\n';
+            return targets;
+        }
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        list = contents;
+    }
+
+    size_t pos = 0;
+    while ((pos = list.find_first_not_of(", \t\n", pos)) != std::string_view::npos) {
+        auto end = list.find_first_of(", \t\n", pos);
+        targets.emplace_back(list.substr(pos, end - pos));
+        pos = end;
+    }
+    return targets;
+}
+
+// Shows the latest sample of every card of every agent in targets, one table
+// row per card and one column per enabled row, see gpu_table. The table is
+// redrawn every redraw nanoseconds, or every second if that is negative.
+int run_collect(const std::vector<std::string> &targets, const row_set &enabled_rows, std::int64_t redraw)
+{
+    event_loop loop;
+    collector agents(loop);
+    for (const auto &target : targets) {
+        if (!agents.add(target)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    signal_fd signals({SIGINT, SIGTERM, SIGWINCH});
+    start_screen();
+
+    gpu_table table(enabled_rows);
+    std::uint64_t generation = 0;
+
+    auto draw = [&]{
+        const auto &gpus = agents.gpus();
+        const auto &all = agents.agents();
+        if (table.size() != gpus.size() || generation != agents.generation()) {
+            std::vector<std::string> names;
+            for (const auto &g : gpus) {
+                const auto &a = all[g.agent];
+                names.push_back(g.card == collector::no_card ? a.label : a.label + " " + a.names[g.card]);
+            }
+            table.set_cards(std::move(names));
+            generation = agents.generation();
+        }
+
+        for (size_t i = 0; i < gpus.size(); ++i) {
+            const auto &g = gpus[i];
+            const auto &a = all[g.agent];
+            if (a.connected && g.card != collector::no_card) {
+                table.set(i, with_derived(a.samples[g.card], a.derived[g.card]), a.limits[g.card]);
+            } else {
+                table.set_status(i, a.status);
+            }
+        }
+        table.draw(0, LINES - 1);
+
+        char status[128];
+        auto n = std::snprintf(status, sizeof(status), "%zu/%zu agents connected  %zu cards  %llu updates",
+                               agents.connected(), all.size(), gpus.size(),
+                               static_cast<unsigned long long>(agents.updates()));
+        move(LINES - 1, hpad);
+        clrtoeol();
+        print_string(color::type::label, std::string_view(status, static_cast<size_t>(std::max(n, 0)))
+                                             .substr(0, static_cast<size_t>(std::max(COLS - hpad, 0))));
+
+        refresh();
+    };
+
+    timer_fd timer;
+    timer.set_period(redraw >= 0 ? std::max(redraw, min_interval) : std::int64_t{1000000000});
+    loop.add(timer.fd(), EPOLLIN, [&](std::uint32_t){
+        if (timer.read() > 0) {
+            agents.connect();
+            draw();
+        }
+    });
+
+    loop.add(STDIN_FILENO, EPOLLIN, [&](std::uint32_t){
+        int key;
+        while ((key = getch()) != ERR) {
+            if (key == 'q' || key == end_of_transmission || key == escape) {
+                loop.stop();
+                return;
+            }
+            if (table.handle_key(key)) {
+                draw();
+            }
+        }
+    });
+
+    loop.add(signals.fd(), EPOLLIN, [&](std::uint32_t){
+        int sig;
+        while ((sig = signals.read()) > 0) {
+            if (sig != SIGWINCH) {
+                loop.stop();
+                return;
+            }
+            handle_winch();
+            draw();
+        }
+    });
+
+    agents.connect();
+    draw();
+    loop.run();
+
+    endwin();
+    return EXIT_SUCCESS;
+}
+// The config file given with --config, or else gpumon/config under
+// $XDG_CONFIG_HOME or ~/.config.
+std::string config_path(int argc, char **argv, bool &given)
+{
+    for (int i = 1; i < argc && argv[i] != std::string_view("--"); ++i) {
+        std::string_view arg = argv[i];
+        if (arg.compare(0, 9, "--config=") == 0) {
+            given = true;
+            return std::string(arg.substr(9));
+        }
+        if (arg == "--config" && i + 1 < argc) {
+            given = true;
+            return argv[i + 1];
+        }
+    }
+
+    if (const char *dir = std::getenv("XDG_CONFIG_HOME"); dir && *dir) {
+        return std::string(dir) + "/gpumon/config";
+    }
+    if (const char *home = std::getenv("HOME"); home && *home) {
+        return std::string(home) + "/.config/gpumon/config";
+    }
+    return {};
+}
+
+// Turns every "key = value" line of the config file at path into an argument
+// "--key=value", for the same parsing as the command line. Blank lines and
+// lines starting with # are skipped. A value of on, yes or true stands for an
+// option without an argument, and off, no or false leaves the option out.
+// Only a config file that was given must exist.
+bool read_config(const std::string &path, std::vector<std::string> &args, bool required)
+{
+    std::ifstream in(path);
+    if (!in) {
+        if (required) {
+            std::cerr << path << ": " << std::strerror(errno) << '\n';
+        }
+        return !required;
+    }
+
+    auto trim = [](std::string_view text){
+        auto first = text.find_first_not_of(" \t\r");
+        if (first == std::string_view::npos) {
+            return std::string_view();
+        }
+        return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+    };
+
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        auto text = trim(line);
+        if (text.empty() || text.front() == '#') {
+            continue;
+        }
+
+        auto equals = text.find('=');
+        auto key = trim(text.substr(0, equals));
+        auto value = equals == std::string_view::npos ? std::string_view("on") : trim(text.substr(equals + 1));
+        if (key.empty() || key == "config") {
+            std::cerr << path << ":" << number << ": invalid line\n";
+            return false;
+        }
+
+        if (value == "off" || value == "no" || value == "false") {
+            continue;
+        }
+        auto arg = "--" + std::string(key);
+        if (value != "on" && value != "yes" && value != "true") {
+            arg.append(1, '=').append(value);
+        }
+        args.push_back(std::move(arg));
+    }
+    return true;
+}
+
+}
+
+#ifdef GPUMON_COUNT_ALLOCATIONS
+// Counts every allocation for the --bench of gpumon_bench. Neither this nor
+// operator delete is inlined, as GCC mistakes the free() of memory from
+// malloc() for a mismatched deallocation otherwise.
+__attribute__((noinline)) void *operator new(std::size_t size)
+{
+    counters::allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    const option options[] = {
+        {"update", required_argument, nullptr, 'u'},
+        {"no-color", no_argument, nullptr, 'n'},
+        {"help", no_argument, nullptr, 'h'},
+        {"disable", required_argument, nullptr, 'd'},
+        {"enable", required_argument, nullptr, 'e'},
+        {"format", required_argument, nullptr, 'f'},
+        {"output", required_argument, nullptr, 'o'},
+        {"interval-ms", required_argument, nullptr, 'i'},
+        {"redraw", required_argument, nullptr, 'r'},
+        {"oversample", required_argument, nullptr, 's'},
+        {"serve", required_argument, nullptr, 'S'},
+        {"record", required_argument, nullptr, 'R'},
+        {"replay", required_argument, nullptr, 'P'},
+        {"backend", required_argument, nullptr, 'B'},
+        {"bench", optional_argument, nullptr, 'b'},
+        {"bench-fake", required_argument, nullptr, 'F'},
+        {"self-stats", no_argument, nullptr, 'T'},
+        {"sysfs-root", required_argument, nullptr, 'Y'},
+        {"fake", required_argument, nullptr, 'K'},
+        {"adaptive", optional_argument, nullptr, 'A'},
+        {"agent", optional_argument, nullptr, 'G'},
+        {"collect", required_argument, nullptr, 'C'},
+        {"alert", required_argument, nullptr, 'L'},
+        {"alert-hook", required_argument, nullptr, 'H'},
+        {"view", required_argument, nullptr, 'V'},
+        {"config", required_argument, nullptr, 'c'},
+        {"once", optional_argument, nullptr, 'O'},
+        {"shm", optional_argument, nullptr, 'M'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    sampler_config config;
+    std::int64_t redraw = -1;
+    auto format = output_format::tui;
+    const char *output = nullptr;
+    const char *serve_address = nullptr;
+    std::string agent_address;
+    std::string shm_name;
+    const char *collect_list = nullptr;
+    const char *record_path = nullptr;
+    const char *replay_path = nullptr;
+    auto source = backend::automatic;
+    long bench_iterations = -1;
+    long bench_fake_cards = -1;
+    bool report_stats = false;
+    std::string sysfs_root = "/sys/class/drm/";
+    long fake_cards = -1;
+    view_options view;
+    std::int64_t once_gap = -1;
+
+    // Applied once it is known whether a recording is played, which shows
+    // every recorded row by default.
+    std::vector<std::pair<const char *, bool>> row_options;
+    auto apply_row_options = [&](row_set rows) {
+        for (const auto &[list, enable] : row_options) {
+            set_row_options(rows, list, enable);
+        }
+        return rows;
+    };
+
+    // The options of the config file come first, so that those on the command
+    // line override them.
+    std::vector<std::string> config_args;
+    bool config_given = false;
+    auto path = config_path(argc, argv, config_given);
+    if (!path.empty() && !read_config(path, config_args, config_given)) {
+        return EXIT_FAILURE;
+    }
+    std::vector<char *> args = {argv[0]};
+    for (auto &arg : config_args) {
+        args.push_back(arg.data());
+    }
+    args.insert(args.end(), argv + 1, argv + argc);
+    args.push_back(nullptr);
+
+    int c;
+    while ((c = getopt_long(static_cast<int>(args.size() - 1), args.data(), "hnu:d:e:f:o:r:s:", options,
+                            nullptr)) != -1) {
+        switch (c) {
+        case 'h':
+            print_help(argv[0]);
+            return EXIT_SUCCESS;
+        case 'n':
+            color::use_color = false;
+            break;
+        case 'u':
+        case 'i':
+        case 'r': {
+            char *end;
+            auto value = std::strtod(optarg, &end);
+            if (end == optarg || *end != '\0') {
+                std::cerr << argv[0] << ": invalid interval '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            (c == 'r' ? redraw : config.interval) = static_cast<std::int64_t>(value * (c == 'i' ? 1e6 : 1e9));
+            break;
+        }
+        case 'O': {
+            char *end;
+            auto value = optarg ? std::strtod(optarg, &end) : 0.0;
+            if (optarg && (end == optarg || *end != '\0' || !(value >= 0.0))) {
+                std::cerr << argv[0] << ": invalid interval '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            once_gap = static_cast<std::int64_t>(value * 1e9);
+            break;
+        }
+        case 'A': {
+            char *end;
+            auto value = optarg ? std::strtod(optarg, &end) : 30.0;
+            if (optarg && (end == optarg || *end != '\0' || !(value > 0.0))) {
+                std::cerr << argv[0] << ": invalid interval '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            config.adaptive_max = static_cast<std::int64_t>(value * 1e9);
+            break;
+        }
+        case 's': {
+            char *end;
+            auto rate = std::strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(rate > 0.0)) {
+                std::cerr << argv[0] << ": invalid oversampling rate '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            config.oversample = static_cast<std::int64_t>(1e9 / rate);
+            break;
+        }
+        case 'd':
+        case 'e':
+            row_options.emplace_back(optarg, c == 'e');
+            break;
+        case 'f':
+            if (optarg == std::string_view("csv")) {
+                format = output_format::csv;
+            } else if (optarg == std::string_view("jsonl")) {
+                format = output_format::jsonl;
+            } else {
+                std::cerr << argv[0] << ": unknown format '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'S':
+            serve_address = optarg;
+            break;
+        case 'G':
+            agent_address = optarg ? optarg : std::string(":") + default_agent_port;
+            break;
+        case 'M':
+            shm_name = optarg ? optarg : gpumon_shm::default_name;
+            break;
+        case 'C':
+            collect_list = optarg;
+            break;
+        case 'L':
+            if (!parse_alert(optarg, config.alerts.emplace_back())) {
+                std::cerr << argv[0] << ": invalid alert '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            config.alert_hook = optarg;
+            break;
+        case 'V':
+            if (!parse_view(optarg, view)) {
+                std::cerr << argv[0] << ": invalid view '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            // Read before any other option.
+            break;
+        case 'T':
+            report_stats = true;
+            break;
+        case 'Y':
+            sysfs_root = optarg;
+            if (sysfs_root.empty() || sysfs_root.back() != '/') {
+                sysfs_root.push_back('/');
+            }
+            break;
+        case 'R':
+            record_path = optarg;
+            break;
+        case 'P':
+            replay_path = optarg;
+            break;
+        case 'b':
+        case 'F':
+        case 'K': {
+            char *end;
+            auto value = optarg ? std::strtol(optarg, &end, 10) : 10000;
+            if (optarg && (end == optarg || *end != '\0' || value <= 0)) {
+                std::cerr << argv[0] << ": invalid count '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            (c == 'b' ? bench_iterations : c == 'F' ? bench_fake_cards : fake_cards) = value;
+            break;
+        }
+        case 'B':
+            if (optarg == std::string_view("auto")) {
+                source = backend::automatic;
+            } else if (optarg == std::string_view("sysfs")) {
+                source = backend::sysfs;
+            } else if (optarg == std::string_view("gpu_metrics")) {
+                source = backend::gpu_metrics;
+            } else if (optarg == std::string_view("ioctl")) {
+#ifdef GPUMON_HAVE_LIBDRM
+                source = backend::ioctl;
+#else
+                std::cerr << argv[0] << ": the ioctl backend needs gpumon to be built with libdrm\n";
+                return EXIT_FAILURE;
+#endif
+            } else {
+                std::cerr << argv[0] << ": unknown backend '" << optarg << "'\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (output && format == output_format::tui) {
+        format = output_format::csv;
+    }
+
+    // Fake cards live in a temporary tree that the generator keeps changing.
+    // It is declared after the tree, so that it stops before the tree is
+    // removed.
+    std::optional<temp_dir> fake_root;
+    std::optional<fake_generator> generator;
+    if (fake_cards > 0 || bench_fake_cards > 0) {
+        auto cards = static_cast<unsigned>(bench_fake_cards > 0 ? bench_fake_cards : fake_cards);
+        fake_root.emplace();
+        if (fake_root->path().empty() || !create_fake_tree(fake_root->path(), cards)) {
+            std::cerr << argv[0] << ": could not create the fake cards\n";
+            return EXIT_FAILURE;
+        }
+        sysfs_root = fake_root->path();
+        if (bench_fake_cards <= 0) {
+            generator.emplace(sysfs_root, cards, fake_period);
+            generator->start();
+        }
+    }
+
+    if (bench_iterations > 0 || bench_fake_cards > 0) {
+        auto iterations = static_cast<unsigned>(bench_iterations > 0 ? bench_iterations : 10000);
+        return run_bench(sysfs_root, iterations);
+    }
+
+    // Without key presses, scrapes or readers to keep the first sample
+    // for, a negative interval writes a single sample like --once.
+    if (config.interval < 0 && !serve_address && agent_address.empty() && shm_name.empty() &&
+        !replay_path && !collect_list && once_gap < 0) {
+        if (record_path) {
+            std::cerr << argv[0] << ": --record needs a positive interval\n";
+            return EXIT_FAILURE;
+        }
+        if (format != output_format::tui) {
+            once_gap = 0;
+        }
+    }
+
+    if (once_gap >= 0) {
+        if (serve_address || record_path || replay_path || collect_list || !agent_address.empty() ||
+            !shm_name.empty()) {
+            std::cerr << argv[0] << ": --once only writes samples to stdout or --output\n";
+            return EXIT_FAILURE;
+        }
+        if (format == output_format::tui) {
+            format = output_format::csv;
+        }
+    }
+
+    if (replay_path) {
+        if (format != output_format::tui || serve_address || record_path || !agent_address.empty() ||
+            !shm_name.empty()) {
+            std::cerr << argv[0] << ": --replay only works with the interactive display\n";
+            return EXIT_FAILURE;
+        }
+        return run_replay(replay_path, apply_row_options(row_set::from_mask(~0u)), redraw, view);
+    }
+
+    if (collect_list) {
+        if (format != output_format::tui || serve_address || record_path || !agent_address.empty() ||
+            !shm_name.empty()) {
+            std::cerr << argv[0] << ": --collect only works with the interactive display\n";
+            return EXIT_FAILURE;
+        }
+        auto targets = collect_targets(collect_list);
+        if (targets.empty()) {
+            std::cerr << argv[0] << ": no agents to collect from\n";
+            return EXIT_FAILURE;
+        }
+        auto enabled_rows = apply_row_options(row_set::defaults());
+        if (enabled_rows.empty()) {
+            std::cout << "All rows disabled. Exiting." << std::endl;
+            return EXIT_SUCCESS;
+        }
+        return run_collect(targets, enabled_rows, redraw);
+    }
+
+    if ((serve_address || record_path || !agent_address.empty() || !shm_name.empty()) &&
+        format == output_format::tui) {
+        format = output_format::none;
+    }
+
+    std::vector<device> devices;
+    for (const auto &card : find_cards(sysfs_root)) {
+        devices.emplace_back(card, sysfs_root + card + "/device/", source);
+        if (source == backend::gpu_metrics && !devices.back().uses_metrics()) {
+            std::cerr << card << ": no usable gpu_metrics, reading sysfs files instead\n";
+        }
+        if (source == backend::ioctl && !devices.back().uses_ioctl()) {
+            std::cerr << card << ": could not query the render node, reading sysfs files instead\n";
+        }
+    }
+
+    if (devices.empty()) {
+        std::cout << "No amdgpu devices found. Exiting." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto enabled_rows = apply_row_options(row_set::defaults());
+    probe_rows(devices, enabled_rows);
+
+    if (enabled_rows.empty()) {
+        std::cout << "All rows disabled. Exiting." << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    shm_publisher shm;
+    if (!shm_name.empty()) {
+        if (!shm.open(shm_name, devices, config.interval)) {
+            return EXIT_FAILURE;
+        }
+        config.shm = &shm;
+    }
+
+    if (format == output_format::tui) {
+        sampler smp(devices, enabled_rows, config);
+        return run_tui(devices, enabled_rows, smp, config.interval, redraw, view);
+    }
+
+    int fd = STDOUT_FILENO;
+    if (output) {
+        fd = ::open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror(output);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (once_gap >= 0) {
+        auto ret = run_once(devices, enabled_rows, format, fd, once_gap);
+        if (output) {
+            ::close(fd);
+        }
+        return ret;
+    }
+
+    int record_fd = -1;
+    if (record_path) {
+        record_fd = ::open(record_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (record_fd < 0) {
+            perror(record_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto ret = run_headless(devices, enabled_rows, config, format, fd, record_fd, serve_address,
+                            agent_address.empty() ? nullptr : agent_address.c_str(), report_stats);
+    if (output) {
+        ::close(fd);
+    }
+    if (record_path) {
+        ::close(record_fd);
+    }
+    return ret;
+}